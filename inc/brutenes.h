@@ -7,14 +7,18 @@
 #include <vector>
 #include <thread>
 #include <atomic>
+#include <condition_variable>
+#include <mutex>
 
 #include "common.h"
 #include "bus.h"
 #include "cpu.h"
 #include "ines.h"
 #include "ppu.h"
+#include "profiler.h"
 #include "scheduler.h"
 #include "controller.h"
+#include "trace.h"
 
 class EmuThread;
 
@@ -32,7 +36,17 @@ public:
     void ColdBoot();
     void RunFrame();
 
-    u16* GetFrame();
+    PPU::Frame GetFrame();
+
+    // Must be called before the emulation thread is started
+    bool SetCPUBackend(CPU::Backend backend);
+    void SetPixelCache(FakeVirtualMemory::PixelCache mode);
+    // Draws frames on this many worker threads instead of the emulation thread, see PPU::SetRenderThreads
+    void SetRenderThreads(u32 workers);
+    bool StartTrace(const std::string& path);
+    void StartProfiler();
+    // Writes the profiler report, if the profiler was started
+    void PrintProfile(std::FILE* out) const;
 
     Controller controller1;
     Controller controller2;
@@ -46,8 +60,6 @@ private:
     Scheduler timing;
 
     std::vector<u8> rom;
-    // When paused, keep the previous frame around so we can keep redrawing it
-    u16* prev_frame{};
 
     std::atomic<bool> stop_signal{};
     bool paused = false;
@@ -56,8 +68,12 @@ private:
     long long last_timer{};
 
     std::mutex controller_mutex{};
+
+    std::unique_ptr<TraceWriter> tracer{};
+    std::unique_ptr<Profiler> profiler{};
 friend class EmuThread;
 friend class Controller;
+friend class Benchmarks;
 };
 
 // Wraps the emu instance in a thread since macos still doesn't have jthread
@@ -71,7 +87,7 @@ public:
     void PressController(u8 controller, BruteNES::Button button) const;
     void ReleaseController(u8 controller, BruteNES::Button button) const;
 
-    [[nodiscard]] u16* GetFrame() const {
+    [[nodiscard]] PPU::Frame GetFrame() const {
         return nes->GetFrame();
     }
 
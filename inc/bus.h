@@ -4,7 +4,8 @@
 #define BRUTENES_BUS_H
 
 #include <array>
-#include <queue>
+#include <bit>
+#include <cstring>
 #include <vector>
 
 #include "common.h"
@@ -17,11 +18,16 @@ class INES;
 class Bus {
 public:
 
-    struct RegisterCacheEntry {
+    // A register access the CPU made without catching the PPU up, stamped with the master clock
+    // cycle it happened on so the PPU can apply it on its exact dot
+    struct RegisterLogEntry {
+        u64 cycle;
         u16 addr;
+        // Value written, or for reads the open bus value the read returned
         u8 value;
         bool is_write;
     };
+    static constexpr u32 REGISTER_LOG_SIZE = 1024;
 
     Bus(const INES& header, std::span<u8> prg, std::span<u8> chr, PPU& ppu,
         Controller& controller1, Controller& controller2);
@@ -50,6 +56,7 @@ public:
         const auto bank = addr / FakeVirtualMemory::BANK_WINDOW;
         const auto offset = addr & (FakeVirtualMemory::BANK_WINDOW-1);
         fakemmu.cpumem[bank][offset] = value;
+        fakemmu.MarkCPUWritten(bank);
     }
 
     constexpr inline bool CheckedRead8(u16 addr, u8& out) {
@@ -79,11 +86,38 @@ public:
         }
         const auto offset = addr & (FakeVirtualMemory::BANK_WINDOW-1);
         // Dont write if not mapped as writable, but return true since it is mapped
-        if ((tag & FakeVirtualMemory::Tag::Write) != 0)
+        if ((tag & FakeVirtualMemory::Tag::Write) != 0) {
             fakemmu.cpumem[bank][offset] = value;
+            fakemmu.MarkCPUWritten(bank);
+        }
         return true;
     }
 
+    inline u8* DirectCPUPageAccess(u16 addr) {
+        const auto bank = addr / FakeVirtualMemory::BANK_WINDOW;
+        return fakemmu.cpumem[bank];
+    }
+
+    inline u8 CPUPageTag(u16 addr) const {
+        const auto bank = addr / FakeVirtualMemory::BANK_WINDOW;
+        return fakemmu.cputag[bank];
+    }
+
+    // Cheap check for whether anything cached from a CPU page (decoded code, say) is stale
+    [[nodiscard]] inline u64 CPUPageGeneration(u16 addr) const {
+        return fakemmu.CPUPageGeneration(addr / FakeVirtualMemory::BANK_WINDOW);
+    }
+    [[nodiscard]] inline bool CPUPageChangedSince(u16 addr, u64 generation) const {
+        return CPUPageGeneration(addr) != generation;
+    }
+
+    // Native code writes RAM directly, so it reports the windows it stored to afterwards
+    inline void MarkCPUWindowsWritten(u64 windows) {
+        for (; windows != 0; windows &= windows - 1) {
+            fakemmu.MarkCPUWritten(std::countr_zero(windows));
+        }
+    }
+
     inline u8 ReadVRAM8(u16 addr) {
         const auto bank = addr / FakeVirtualMemory::BANK_WINDOW;
         const auto offset = addr & (FakeVirtualMemory::BANK_WINDOW-1);
@@ -95,14 +129,35 @@ public:
         return fakemmu.ppumem[bank];
     }
 
-    inline u8* PixelCacheLookup(u16 addr, u8 fine_y) {
+    // Copies the pattern tables and nametables as the PPU sees them through the current mapping
+    inline void CopyVRAM(std::array<u8, 0x3000>& out) const {
+        for (u32 bank = 0; bank < out.size() / FakeVirtualMemory::BANK_WINDOW; bank++) {
+            std::memcpy(&out[bank * FakeVirtualMemory::BANK_WINDOW], fakemmu.ppumem[bank], FakeVirtualMemory::BANK_WINDOW);
+        }
+    }
+
+    // Returns the 8 decoded pixels of a tile row, leftmost in the low byte and mirrored if
+    // flip_h is set
+    inline u64 PixelRowLookup(u16 addr, u8 fine_y, bool flip_h = false) {
         constexpr int TILE_STRIDE = 64;
         constexpr int PIXEL_STRIDE = 8;
+        // Rows 8-15 of 8x16 sprites are in the next tile, which has to be decoded on its own
+        addr += (fine_y & 8) * 2;
+        fine_y &= 7;
         const auto bank = addr / FakeVirtualMemory::BANK_WINDOW;
         const auto tile_addr = addr & (FakeVirtualMemory::BANK_WINDOW-1);
-        int x = ((tile_addr >> 4) & 0xf) * TILE_STRIDE;
-        int y = ((tile_addr >> 8) & 0xf) * TILE_STRIDE * 16 + fine_y * PIXEL_STRIDE;
-        return &fakemmu.chr_pixel_map[bank][x + y];
+        const auto tile = fakemmu.CHRTileIndex(bank, tile_addr & ~0xf);
+        if (fakemmu.CHRTileDirty(tile)) [[unlikely]] {
+            fakemmu.DecodeCHRTile(tile);
+        }
+        u64 row;
+        if (fakemmu.pixel_cache == FakeVirtualMemory::PixelCache::Packed) {
+            row = fakemmu.ExpandPackedRow(fakemmu.packed_pixel_cache[tile * 8 + fine_y]);
+        } else {
+            std::memcpy(&row, &fakemmu.decoded_pixel_cache[tile * TILE_STRIDE + fine_y * PIXEL_STRIDE], sizeof(row));
+        }
+        // Pixels are one per byte, so mirroring the row is a byte swap
+        return flip_h ? std::byteswap(row) : row;
     }
 
 //    inline u16 ReadVRAM16(u16 addr) {
@@ -112,20 +167,123 @@ public:
 //        addr &= 0x3fff;
         const auto bank = addr / FakeVirtualMemory::BANK_WINDOW;
         const auto offset = addr & (FakeVirtualMemory::BANK_WINDOW-1);
+        // Writes to CHR ROM are dropped
+        if ((fakemmu.pputag[bank] & FakeVirtualMemory::Tag::Write) == 0)
+            return;
         fakemmu.ppumem[bank][offset] = value;
+        vram_write_generation++;
+        if (addr < 0x2000) {
+            fakemmu.MarkCHRWritten(bank, offset);
+        } else if (addr < 0x3f00) {
+            fakemmu.MarkNametableWritten(bank, offset);
+        }
+    }
+
+    // Same as WriteVRAM8 for count bytes stride apart, all inside the bank window addr is in
+    inline void WriteVRAMRun(u16 addr, const u8* data, u32 count, u16 stride) {
+        const auto bank = addr / FakeVirtualMemory::BANK_WINDOW;
+        const auto offset = addr & (FakeVirtualMemory::BANK_WINDOW-1);
+        // Writes to CHR ROM are dropped
+        if ((fakemmu.pputag[bank] & FakeVirtualMemory::Tag::Write) == 0)
+            return;
+        u8* dst = fakemmu.ppumem[bank] + offset;
+        vram_write_generation++;
+        if (stride == 1) {
+            std::memcpy(dst, data, count);
+        } else {
+            for (u32 i = 0; i < count; i++) {
+                dst[i * stride] = data[i];
+            }
+        }
+        const u32 end = offset + (count - 1) * stride + 1;
+        if (addr < 0x2000) {
+            // Going down a column can mark a few tiles it skipped over, which only costs a decode
+            for (u32 tile = offset & ~0xf; tile < end; tile += 16) {
+                fakemmu.MarkCHRWritten(bank, tile);
+            }
+        } else if (addr < 0x3f00) {
+            for (u32 i = 0; i < count; i++) {
+                fakemmu.MarkNametableWritten(bank, offset + i * stride);
+            }
+        }
+    }
+
+    inline void SetPixelCache(FakeVirtualMemory::PixelCache mode) {
+        fakemmu.SetPixelCache(mode);
+    }
+
+    // Tile palettes of a nametable row, see FakeVirtualMemory::NametableRowPalettes
+    inline const u8* NametableRowPalettes(u16 addr) {
+        return fakemmu.NametableRowPalettes(addr / FakeVirtualMemory::BANK_WINDOW, (addr >> 5) & 0x1f);
+    }
+
+    inline void CatchUpPPU() {
+        ppu.CatchUp();
+    }
+
+    [[nodiscard]] inline u64 NextVBlankEdge() const {
+        return ppu.NextVBlankEdge();
+    }
+
+    // Reads $2002 at master clock cycle `at` without catching the PPU up, see PPU::PredictStatus.
+    // Returns false if the PPU has to be caught up and read normally.
+    inline bool PredictPPUStatusRead(u64 at, u8& out) {
+        // Logged writes to the registers sprite 0 depends on could move the hit
+        constexpr u8 sprite_zero_registers = 1 << 0 | 1 << 1 | 1 << 4;
+        if ((ppu_register_log_written & sprite_zero_registers) != 0 || !ppu.PredictStatus(at, out)) {
+            return false;
+        }
+        if (!PPURegisterLogEmpty()) {
+            // Open bus is whatever the last logged access left on it
+            const auto& last = ppu_register_log[(ppu_register_log_tail - 1) % REGISTER_LOG_SIZE];
+            out = (out & ~0x1f) | (last.value & 0x1f);
+        }
+        // The write toggle reset has to land after any logged writes, so it goes in the log too
+        LogPPURegister(at, 0x2002, out, false);
+        return true;
     }
 
     inline u8 ReadPPURegister(u16 addr) {
         return ppu.ReadRegister(addr);
     }
-    inline void WritePPURegister(u16 addr, u8 value, bool use_ppu_cache) {
-        if (use_ppu_cache) {
-            ppu_register_cache.emplace(RegisterCacheEntry{ addr, value, true });
+    // With the log on, the write is applied on its dot the next time the PPU catches up
+    inline void WritePPURegister(u16 addr, u8 value, bool use_ppu_log, u64 cycle) {
+        if (use_ppu_log) {
+            LogPPURegister(cycle, addr, value, true);
         } else {
             ppu.WriteRegister(addr, value);
         }
     }
 
+    // Copies CPU page `page` into OAM. The copy is taken now, and with the log on it reaches
+    // OAM on the cycle the transfer finishes the next time the PPU catches up.
+    inline void OAMDMA(u8 page, bool use_ppu_log, u64 cycle) {
+        // The staging copy belongs to any transfer (or $2004 write) still in the log, so apply that first
+        if (use_ppu_log && (ppu_register_log_written & (1 << 4)) != 0) {
+            ppu.CatchUp();
+        }
+        const u16 addr = page << 8;
+        const u8 tag = CPUPageTag(addr);
+        const u8* src = DirectCPUPageAccess(addr);
+        // The transfer reads the backing memory directly and never goes through the register
+        // handlers. A page never straddles two bank windows.
+        if ((tag & FakeVirtualMemory::Tag::Read) != 0 && src != nullptr) {
+            std::memcpy(oam_dma_page.data(), src + (addr & (FakeVirtualMemory::BANK_WINDOW-1)), oam_dma_page.size());
+        } else {
+            // Register and unmapped windows have no backing memory, so the whole page is open bus
+            oam_dma_page.fill(OpenBus());
+        }
+        if (use_ppu_log) {
+            LogPPURegister(cycle, 0x4014, page, true);
+        } else {
+            ppu.OAMDMA(oam_dma_page);
+        }
+    }
+
+    [[nodiscard]] inline bool PPURegisterLogEmpty() const {
+        return ppu_register_log_head == ppu_register_log_tail;
+    }
+
     inline u8 ReadAPURegister(u16 addr) {
         if (addr == 0x4016 || addr == 0x4017) {
             if (addr & 1) {
@@ -151,10 +309,29 @@ public:
 
     // Latest vram address from the PPU increment
     u16 vram_addr{};
+    // Bumped on every write below the palette, so anything copied out of VRAM can tell it's stale
+    u64 vram_write_generation{};
 
-    std::queue<RegisterCacheEntry> ppu_register_cache{};
+    // Ring buffer of logged register accesses. Head and tail count up forever and wrap on indexing.
+    std::array<RegisterLogEntry, REGISTER_LOG_SIZE> ppu_register_log{};
+    u32 ppu_register_log_head{};
+    u32 ppu_register_log_tail{};
+    // One bit per register number written since the log was last empty. OAM DMA counts as $2004.
+    u8 ppu_register_log_written{};
+    // Source page of the last OAM DMA
+    std::array<u8, 256> oam_dma_page{};
 
 private:
+    inline void LogPPURegister(u64 cycle, u16 addr, u8 value, bool is_write) {
+        if (ppu_register_log_tail - ppu_register_log_head == REGISTER_LOG_SIZE) {
+            // Full, so apply everything so far. The PPU runs ahead of the scheduler to get to them.
+            ppu.CatchUp();
+        }
+        ppu_register_log[ppu_register_log_tail++ % REGISTER_LOG_SIZE] = RegisterLogEntry{ cycle, addr, value, is_write };
+        if (is_write) {
+            ppu_register_log_written |= 1 << (addr & 0b111);
+        }
+    }
 
 //    void InitHostMMU(std::span<u8> prg, std::span<u8> chr);
 //    void InitFakeMMU(std::span<u8> prg, std::span<u8> chr);
@@ -177,6 +354,7 @@ private:
 //    std::array<std::span<u8>, 8> chrmap{};
 //    std::array<std::span<u8>, 4> nmtmap{};
 //    std::span<u8> palette;
+friend class Benchmarks;
 };
 
 
@@ -8,23 +8,111 @@
 
 #include "bus.h"
 #include "common.h"
+#include "recompiler.h"
 
 class CPU;
 class PPU;
 class Scheduler;
+class Profiler;
+class TraceWriter;
+
+// A single predecoded instruction. The operand holds the raw bytes following the
+// opcode, and the handler is the interpreter label that executes it.
+struct DecodedInstruction {
+    // Number of common instruction pairs and triples the interpreter has a single fused handler for
+    static constexpr int FUSED_PAIRS = 20;
+    static constexpr int FUSED_TRIPLES = 5;
+    static constexpr int FUSED_HANDLERS = FUSED_PAIRS + FUSED_TRIPLES;
+
+    void* handler;
+    u16 operand;
+    u8 opcode;
+    u8 length;
+    u8 cycles;
+    // One past the index of the fused handler this instruction starts, pairs first and then
+    // triples, or zero if it runs on its own. A fused handler runs this instruction and the one
+    // or two after it without going back through dispatch.
+    u8 fused;
+};
+
+// A straight line run of instructions that ends at the first control flow instruction
+struct DecodedBlock {
+    static constexpr int MAX_INSTRUCTIONS = 16;
+
+    // Blocks that branch back to their own start without any side effects. Once one has
+    // looped, every later iteration does the same thing until something outside the CPU changes.
+    enum class IdleLoop : u8 {
+        None,
+        // Only reads plain memory, so nothing changes until the next scheduler event
+        Memory,
+        // Polls the vblank flag with LDA/BIT $2002 and BPL/BMI
+        PPUStatus,
+    };
+
+    // Backing page the block was decoded from, used together with the PC as the cache key
+    const u8* page{};
+    // Each interpreter specialization has its own labels, so this is the table the handlers came from
+    const std::array<void*, 256 + DecodedInstruction::FUSED_HANDLERS>* handlers{};
+    u16 pc{};
+    // Sum of the base cycle counts of every instruction in the block
+    u16 cycles{};
+    u8 count{};
+    IdleLoop idle{};
+    // Cycles for one full iteration of an idle loop including the branch back
+    u16 idle_cycles{};
+    std::array<DecodedInstruction, MAX_INSTRUCTIONS> code{};
+    // Write generation of the page when the block was decoded. Blocks from writable memory
+    // are decoded again once it changes.
+    u64 generation{};
+    // Translated code for this block, only valid while native_epoch matches the recompiler
+    const NativeBlock* native{};
+    u32 native_epoch{};
+};
 
 class Interpreter {
 public:
+    // One handler per opcode followed by one per fused pair and triple
+    using HandlerTable = std::array<void*, 256 + DecodedInstruction::FUSED_HANDLERS>;
+    static constexpr int BLOCK_CACHE_SIZE = 4096;
+
     Interpreter(Bus& bus, CPU& cpu, Scheduler& timing)
-        : bus(bus), cpu(cpu), timing(timing) {}
+        : bus(bus), cpu(cpu), timing(timing), recompiler(bus) {}
+
+    // Instrument enables the trace and profiler hooks, which are compiled out otherwise
+    template <bool UsePPUCache, bool Instrument>
+    u32 RunBlock(u32 max_cycles);
+
+    // Returns false if native code isn't available on this host
+    bool EnableRecompiler(bool enable);
 
-    u32 RunBlock(u32 max_cycles, bool use_ppu_cache);
+    void SetTracer(TraceWriter* writer) { tracer = writer; }
+    void SetProfiler(Profiler* prof) { profiler = prof; }
 private:
+    DecodedBlock* LookupBlock(u16 pc, const HandlerTable& handlers);
+    // Runs native blocks starting from block for as long as they fit in the cycle budget,
+    // and returns the block the interpreter should continue with
+    DecodedBlock* RunNative(DecodedBlock* block, u32& current_cycles, u32 max_cycles, const HandlerTable& handlers);
+    void DecodeBlock(DecodedBlock& block, u16 pc, const HandlerTable& handlers, int max_instructions);
+    u8 FetchCode8(u16 addr);
+    void DetectIdleLoop(DecodedBlock& block);
+    void FuseInstructions(DecodedBlock& block, const HandlerTable& handlers);
+    // Returns how many cycles of whole idle loop iterations can be skipped without changing the outcome
+    u32 IdleLoopSkip(const DecodedBlock& block, u32 current_cycles, u32 committed_cycles, u32 max_cycles);
+
     Bus& bus;
     CPU& cpu;
     Scheduler& timing;
 
-    u16 prev_pc{};
+    // Direct mapped cache of blocks decoded from read only memory
+    std::array<DecodedBlock, BLOCK_CACHE_SIZE> block_cache{};
+    // Scratch block for code that can't be cached, such as an instruction straddling two windows
+    DecodedBlock uncached_block{};
+
+    Recompiler recompiler;
+    bool use_recompiler{};
+
+    TraceWriter* tracer{};
+    Profiler* profiler{};
 };
 
 class CPU {
@@ -35,6 +123,11 @@ public:
     CPU() = delete;
     explicit CPU(Bus& bus, Scheduler& timing) : bus(bus), timing(timing), interpreter(bus, *this, timing) { Reset(); }
 
+    enum class Backend {
+        Interpreter,
+        Recompiler,
+    };
+
     enum Flags {
         C = 1 << 0,
         Z = 1 << 1,
@@ -46,17 +139,68 @@ public:
         N = 1 << 7,
     };
 
-    constexpr void SetNZ(u8 value) {
+    // Sets Z if z is zero and N from bit 7 of n
+    constexpr void SetZN(u8 z, u8 n) {
+#ifdef BRUTENES_LAZY_FLAGS
+        z_result = z;
+        n_result = n;
+#else
         P = (P & ~(Flags::N | Flags::Z))
-                | ((value == 0) << std::countr_zero((u8)Flags::Z))
-                | ((value & 0x80));
+                | ((z == 0) << std::countr_zero((u8)Flags::Z))
+                | ((n & 0x80));
+#endif
+    }
+
+    constexpr void SetNZ(u8 value) {
+        SetZN(value, value);
     }
 
     template<Flags F>
     constexpr void SetFlag(bool result) {
+#ifdef BRUTENES_LAZY_FLAGS
+        if constexpr (F == Flags::Z) {
+            z_result = !result;
+            return;
+        } else if constexpr (F == Flags::N) {
+            n_result = result ? 0x80 : 0;
+            return;
+        }
+#endif
         P = (P & ~F) | ((result) << std::countr_zero((u8)F));
     }
 
+    template<Flags F>
+    [[nodiscard]] constexpr bool GetFlag() const {
+#ifdef BRUTENES_LAZY_FLAGS
+        if constexpr (F == Flags::Z) {
+            return z_result == 0;
+        } else if constexpr (F == Flags::N) {
+            return (n_result & 0x80) != 0;
+        }
+#endif
+        return (P & F) != 0;
+    }
+
+    // The full status register. With lazy flags N and Z only live in the last results,
+    // so anything that reads or replaces P as a whole has to go through these.
+    [[nodiscard]] constexpr u8 GetP() const {
+#ifdef BRUTENES_LAZY_FLAGS
+        return (P & ~(Flags::N | Flags::Z))
+                | ((z_result == 0) << std::countr_zero((u8)Flags::Z))
+                | (n_result & 0x80);
+#else
+        return P;
+#endif
+    }
+
+    constexpr void SetP(u8 value) {
+        P = value;
+#ifdef BRUTENES_LAZY_FLAGS
+        z_result = (value & Flags::Z) ? 0 : 1;
+        n_result = value & Flags::N;
+#endif
+    }
+
     inline void PushStack(u8 value) {
         bus.Write8(0x100 | SP--, value);
     }
@@ -66,12 +210,27 @@ public:
 
     void Reset();
 
-    // Runs until the expected cycle count or MMIO page is accessed
-    u32 RunFor(u64 cycles, bool use_ppu_cache);
+    // Runs for at least the given number of cycles and adds them to the scheduler.
+    // MMIO accesses catch the PPU up to the cycle they happen on, except PPU register writes
+    // when use_ppu_log is set, which go into the bus register log instead.
+    u32 RunFor(u64 cycles, bool use_ppu_log);
+
+    // Falls back to the interpreter and returns false if the backend isn't supported
+    bool SetBackend(Backend backend);
+
+    // Records every instruction the interpreter runs into writer, or stops tracing if it's null.
+    // The recompiler is bypassed while tracing so nothing is missed.
+    void SetTrace(TraceWriter* writer);
+    void SetProfiler(Profiler* prof);
 
     u16 PC{};
     u8 SP{};
     u8 P{};
+#ifdef BRUTENES_LAZY_FLAGS
+    // Last values that set Z and N
+    u8 z_result{1};
+    u8 n_result{};
+#endif
     u8 A{};
     u8 X{};
     u8 Y{};
@@ -83,6 +242,10 @@ private:
     Bus& bus;
     Scheduler& timing;
     Interpreter interpreter;
+    TraceWriter* tracer{};
+    Profiler* profiler{};
+    bool instrumented{};
+friend class Benchmarks;
 };
 
 
@@ -3,11 +3,21 @@
 #ifndef BRUTENES_PPU_H
 #define BRUTENES_PPU_H
 
-#include <mutex>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
 
 #include "common.h"
+#include "renderpool.h"
 #include "scheduler.h"
 
+// The SSE4.1 scanline compositor is only picked at runtime if the host supports it, so all
+// it needs is a compiler that can target it
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BRUTENES_PPU_SSE41 1
+#endif
+
 class Bus;
 class Scheduler;
 
@@ -15,14 +25,24 @@ class PPU {
 public:
     constexpr static auto CYCLES_PER_SCANLINE = 341 * Scheduler::NTSC_PPU_CLOCK_DIVIDER;
 
-    explicit PPU(Bus& bus, Scheduler& timing) : bus(bus), timing(timing), swap_mutex() {}
+    explicit PPU(Bus& bus, Scheduler& timing) : bus(bus), timing(timing) {}
 
     u8 ReadRegister(u16 addr);
     void WriteRegister(u16 addr, u8 value);
 
+    // Runs the PPU up to the scheduler's cycle count, applying the logged register accesses on the
+    // dots they happened on, then posts its next vblank and sprite 0 events
     void CatchUp();
-    void Tick();
-    void OAMDMA();
+
+    // Master clock cycle of the next dot where the vblank flag changes
+    [[nodiscard]] u64 NextVBlankEdge() const;
+    // Works out $2002 as it would read at master clock cycle `at` without catching up, ignoring
+    // any logged register writes. Until then the PPU only runs on what it already has, so vblank
+    // and sprite 0 follow from where it is now. Returns false if sprite 0 could hit before `at`,
+    // or it's over a frame away.
+    bool PredictStatus(u64 at, u8& out) const;
+    // Writes a whole page to OAM starting at OAMADDR, as 256 writes to $2004 would
+    void OAMDMA(const std::array<u8, 256>& page);
 
     bool even_frame{true};
 
@@ -124,22 +144,40 @@ VSO. ....
         return mask.bg_enable || mask.sp_enable;
     }
 
-    u16* LockBuffer() {
-        std::unique_lock<std::mutex> lock(swap_mutex);
-        std::swap(front_buffer, back_buffer);
-        return front_buffer;
-    }
+    // A finished frame and its number, counting up from 1. Sequence 0 is the blank frame shown
+    // before the first one is done.
+    struct Frame {
+        const u16* pixels;
+        u64 sequence;
+    };
 
-    void SwapBuffer() {
-        std::unique_lock<std::mutex> lock(swap_mutex);
-        std::swap(back_buffer, rendering_to);
+    // Presenter side. Picks up the newest finished frame if there's one it hasn't seen yet, and
+    // otherwise hands back the one it already has. Never blocks.
+    Frame LatestFrame() {
+        if (ready_buffer.load(std::memory_order_relaxed) & NEW_FRAME) {
+            front_index = ready_buffer.exchange(front_index, std::memory_order_acq_rel) & BUFFER_INDEX;
+        }
+        return Frame{ buffers[front_index], buffer_sequence[front_index] };
     }
 
+    // Emulator side. Publishes the frame that was just rendered and starts on another, without
+    // ever waiting on the presenter. With render threads it hands the frame just recorded to the
+    // workers and publishes the one they drew before, waiting on them if they're behind.
+    void SwapBuffer();
+
+    // Moves drawing the pixels onto `workers` threads, or back onto the emulator thread with 0.
+    // The emulator then only records the registers, palette, OAM and VRAM each scanline is drawn
+    // with, and the workers draw a band of lines each from that a frame later.
+    void SetRenderThreads(u32 workers);
+
     // Internal scanline cycle count
     u16 scanline{SCANLINE_VBLANK_START};
     u16 cycle{};
 
 private:
+    static constexpr int SCANLINE_VBLANK_START = 240;
+    static constexpr int SCANLINE_FRAME_START = 0;
+    static constexpr int SCANLINE_PRERENDER = 261;
 
     u8 oam_addr{};
 
@@ -150,43 +188,160 @@ private:
 
     u8 latch{};
 
+    // The sprites evaluation found for a line, as the sprite fetches leave them for the next
+    // one. Each row of pixels is already mirrored if the sprite is flipped.
+    struct EvaluatedSprites {
+        struct Sprite {
+            u64 pixels;
+            u8 x;
+            u8 attr;
+        };
+        u8 count;
+        std::array<Sprite, 8> sprites;
+    };
+    // Everything a render worker needs to draw pixels [first, last) of a line
+    struct SpanSnapshot {
+        u16 line;
+        u16 first;
+        u16 last;
+        u16 v;
+        u8 x;
+        PPUCTRL ctrl;
+        PPUMASK mask;
+        // Indices of the VRAM copy and the sprite evaluation in the frame the span was drawn with
+        u16 vram;
+        u16 sprites;
+        std::array<u8, 0x20> palette;
+    };
+    // One frame of spans, with a new copy of VRAM each time it changed during it and of the
+    // evaluated sprites each time evaluation ran
+    struct FrameSnapshot {
+        std::vector<SpanSnapshot> spans;
+        // Pattern tables and nametables, $0000-$2fff
+        std::vector<std::array<u8, 0x3000>> vram;
+        std::vector<EvaluatedSprites> sprites;
+        u16* target;
+    };
+
+    void PublishFrame();
+    // Notes the span down for the render workers, copying VRAM and the evaluated sprites if they changed
+    void RecordScanlineSpan(u16 first, u16 last);
+
+    // Runs up to (but not including) the dot that starts at master clock cycle `target`
+    void RunUntil(u64 target);
     void RunFastScanline();
-    void FastScanlineRender();
+    // Master clock cycle dot `dot` of `line` runs on next, counting from the current position
+    [[nodiscard]] u64 NextDotCycle(u16 line, u16 dot) const;
+    // Earliest master clock cycle the sprite 0 flag could be set on, with the registers and OAM as they are now
+    [[nodiscard]] u64 NextSpriteZeroCycle() const;
+    // Posts the vblank and sprite 0 events coming up from the current position, unless they're already queued
+    void ScheduleEvents();
+    // Runs the current scanline up to (not including) end_cycle, for catch ups that stop partway
+    // through a line
+    void RunScanlineSpan(u16 end_cycle);
+    // Draws pixels [first, last) of a visible scanline with the registers as they are now
+    void RenderScanlineSpan(u16 first, u16 last);
+    // Background and sprite pixels of the span into out, starting from the tile at start_coarse_x
+    void DrawScanlineSpan(u16 first, u16 last, u8 start_coarse_x, u16* out);
     void FastOAMEvaluation();
+    void BuildOAMBuckets();
+    // Replays the buggy overflow scan for a line, starting at the OAM byte after its eighth sprite
+    [[nodiscard]] bool EvaluateSpriteOverflow(u16 line, u16 n, u8 sprite_size) const;
+
+    using ComposeScanlineFn = bool (*)(const u8* bg, const u8* sp_pixel, const u8* sp_attr, const u8* pal,
+                                       u16* out, int first, int last, int sprite_zero_first);
+    static bool ComposeScanlineScalar(const u8* bg, const u8* sp_pixel, const u8* sp_attr, const u8* pal,
+                                      u16* out, int first, int last, int sprite_zero_first);
+#ifdef BRUTENES_PPU_SSE41
+    static bool ComposeScanlineSSE41(const u8* bg, const u8* sp_pixel, const u8* sp_attr, const u8* pal,
+                                     u16* out, int first, int last, int sprite_zero_first);
+#endif
+    static ComposeScanlineFn SelectComposeScanline();
+    // Lays the sprites over the sprite pixel and attribute buffers, earlier sprites in front
+    static void DrawEvaluatedSprites(const EvaluatedSprites& evaluated, u8* sp_pixel, u8* sp_attr);
+    // Same as compose, except sprites are hidden wherever mask hides them
+    static bool ComposeMaskedScanline(ComposeScanlineFn compose, PPUMASK mask, const u8* bg, const u8* sp_pixel,
+                                      const u8* sp_attr, const u8* pal, u16* out, int first, int last,
+                                      int sprite_zero_first);
+    // Draws the spans of lines [first_line, last_line) into the frame's target. Only reads the
+    // snapshot, so any number of workers can draw their own bands of a frame at once.
+    static void RenderSnapshotBand(const FrameSnapshot& frame, u16 first_line, u16 last_line,
+                                   ComposeScanlineFn compose);
+    // Chosen once for the host CPU
+    ComposeScanlineFn compose_scanline = SelectComposeScanline();
+    // Applies the run of logged $2007 writes at the head of the register log as bulk copies,
+    // while nothing else can touch v. Returns how many entries it used.
+    u32 ApplyVRAMUpload();
     void IncrementV();
     inline void IncrementHScroll();
     inline void IncrementVScroll();
     inline void CopyHScrollToV();
 
     bool spriteZeroFound{false};
-    std::array<u8, 32> secondaryOAM{};
+    // OAM offsets of the sprites sprite evaluation finds on each visible line, rebuilt
+    // whenever OAM or the sprite size changes
+    std::array<std::array<u8, 8>, SCANLINE_VBLANK_START> line_sprites{};
+    std::array<u8, SCANLINE_VBLANK_START> line_sprite_count{};
+    std::array<bool, SCANLINE_VBLANK_START> line_sprite_overflow{};
+    bool oam_buckets_dirty{true};
+    u8 oam_bucket_sprite_size{};
+    bool sprite_buffers_dirty{true};
     std::array<u8, 256> OAM{};
+    // What FastOAMEvaluation found last, and a count of how many times it ran so the render
+    // snapshots can tell when to copy it again
+    EvaluatedSprites evaluated_sprites{};
+    u64 evaluated_sprites_generation{};
     std::array<u8, 0x20> palette{};
 
     Bus& bus;
     Scheduler& timing;
     u64 current_cycle{};
+    // Cycles of the events already in the scheduler queue, so each one is only posted once
+    u64 scheduled_vblank_set{~0ull};
+    u64 scheduled_vblank_clear{~0ull};
+    u64 scheduled_sprite_zero{~0ull};
 
     std::array<u16, 256 * 240> pixel_buffer1{};
     std::array<u16, 256 * 240> pixel_buffer2{};
     std::array<u16, 256 * 240> pixel_buffer3{};
 
-    std::mutex swap_mutex{};
-    u16* front_buffer = pixel_buffer1.data();
-    u16* back_buffer = pixel_buffer2.data();
-    u16* rendering_to = pixel_buffer3.data();
     std::array<u16*, 3> buffers = {pixel_buffer1.data(), pixel_buffer2.data(), pixel_buffer3.data()};
+    // Triple buffer. The emulator renders into one buffer and the presenter reads another, and the
+    // third holds the newest finished frame. Handing a frame over swaps an index with the middle
+    // slot in a single exchange, so neither side can see a buffer the other is still using.
+    static constexpr u8 BUFFER_INDEX = 0b011;
+    // Set in ready_buffer until the presenter picks the frame up
+    static constexpr u8 NEW_FRAME = 0b100;
+    std::atomic<u8> ready_buffer{1};
+    // Only touched by the presenter
+    u8 front_index{0};
+    // Only touched by the emulator, along with frame_sequence
+    u8 render_index{2};
+    u16* rendering_to = pixel_buffer3.data();
+    u64 frame_sequence{};
+    // Written before the buffer is published, so the exchange makes it visible along with the pixels
+    std::array<u64, 3> buffer_sequence{};
 
     static constexpr u8 SPRITE_ZERO_TAG = 1 << 2;
     std::array<u8, 8 * 32> scanline_sp_palette_buffer{};
     std::array<u8, 8 * 32> scanline_sp_attribute{};
-    std::array<u16, 8 * 32> scanline_bg_pixel_buffer{};
+    // Background pixels as 4 bit palette indices, one tile per 8 pixel group of the scanline, with one
+    // tile extra so fine X can start anywhere in the first
+    alignas(16) std::array<u8, 8 * 33> scanline_bg_index_buffer{};
 
     u8 read_buffer{};
 
-    static constexpr int SCANLINE_VBLANK_START = 240;
-    static constexpr int SCANLINE_FRAME_START = 0;
-    static constexpr int SCANLINE_PRERENDER = 261;
+    // The frame being recorded and the one the workers are drawing
+    std::array<FrameSnapshot, 2> snapshots{};
+    u8 recording_snapshot{};
+    bool snapshot_in_flight{};
+    u64 snapshot_vram_generation{};
+    u64 snapshot_sprites_generation{};
+    // With render threads the frame buffer belongs to the workers, so sprite 0 lines are drawn here
+    std::array<u16, 256> sprite_zero_line{};
+    // Declared last so the workers are stopped before anything they read goes away
+    std::unique_ptr<RenderPool> render_pool;
+friend class Benchmarks;
 };
 
 
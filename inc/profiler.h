@@ -0,0 +1,80 @@
+
+#ifndef BRUTENES_PROFILER_H
+#define BRUTENES_PROFILER_H
+
+#include <array>
+#include <cstdio>
+#include <memory>
+
+#include "common.h"
+
+// Counts where the interpreter spends its time. Everything is keyed on the guest PC, which
+// is fine while only NROM is supported but will merge banks once mappers exist.
+class Profiler {
+public:
+    struct Counter {
+        u64 count;
+        u64 cycles;
+    };
+
+    Profiler();
+
+    inline void Instruction(u16 pc, u8 opcode, u32 cycles) {
+        auto& per_pc = counters->pc[pc];
+        per_pc.count++;
+        per_pc.cycles += cycles;
+        auto& per_opcode = counters->opcode[opcode];
+        per_opcode.count++;
+        per_opcode.cycles += cycles;
+    }
+
+    // Cycles fast forwarded over by idle loop detection are charged to the loop
+    inline void IdleSkip(u16 pc, u32 cycles) {
+        counters->pc[pc].cycles += cycles;
+        counters->idle_cycles += cycles;
+    }
+
+    // An instruction that had to catch the PPU up before touching a register
+    inline void MMIOSync(u16 pc) {
+        counters->mmio_syncs[pc]++;
+    }
+
+    // A $2002 read answered without catching the PPU up
+    inline void PredictedStatusRead(u16 pc) {
+        counters->predicted_status_reads[pc]++;
+    }
+
+    // An indirect jump to an instruction handler. Fused pairs and triples run two or
+    // three instructions per dispatch.
+    inline void Dispatch() {
+        counters->dispatches++;
+    }
+
+    // The instruction the interpreter returned to RunFrame after
+    inline void BlockExit(u16 pc) {
+        counters->block_exits[pc]++;
+    }
+
+    void Reset();
+
+    // Instructions run and handler dispatches made since the last reset. Without fusion the two are the same.
+    [[nodiscard]] u64 Instructions() const;
+    [[nodiscard]] u64 Dispatches() const { return counters->dispatches; }
+
+    // Writes the top entries of every table, sorted from most to least expensive
+    void Report(std::FILE* out, size_t top = 32) const;
+
+private:
+    struct Counters {
+        std::array<Counter, 0x10000> pc;
+        std::array<Counter, 256> opcode;
+        std::array<u64, 0x10000> mmio_syncs;
+        std::array<u64, 0x10000> predicted_status_reads;
+        std::array<u64, 0x10000> block_exits;
+        u64 idle_cycles;
+        u64 dispatches;
+    };
+    std::unique_ptr<Counters> counters;
+};
+
+#endif //BRUTENES_PROFILER_H
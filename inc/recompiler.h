@@ -0,0 +1,82 @@
+
+#ifndef BRUTENES_RECOMPILER_H
+#define BRUTENES_RECOMPILER_H
+
+#include <array>
+#include <vector>
+
+#include "common.h"
+
+class Bus;
+struct DecodedBlock;
+struct DecodedInstruction;
+
+// The native backend emits System V x86-64 code, so only enable it where that's what we run on
+#if defined(__x86_64__) && !defined(_WIN32)
+#define BRUTENES_RECOMPILER_X64 1
+#endif
+
+// Guest registers handed to a native block on entry and written back on exit
+struct GuestState {
+    u8 A;
+    u8 X;
+    u8 Y;
+    u8 P;
+    u16 PC;
+    u8* ram;
+};
+
+struct NativeBlock {
+    // Runs the block and returns the number of CPU cycles it took
+    u32 (*entry)(GuestState* state);
+    // Worst case cycle count, used to check the whole block fits in the remaining budget
+    u16 max_cycles;
+    // One bit per bank window the block can store to. Native stores go straight to memory,
+    // so the caller marks these as written after running the block.
+    u64 written_windows;
+};
+
+// Translates decoded 6502 blocks from PRG ROM into native x86-64 code. Guest registers
+// live in host registers for the length of a block. Only instructions that can never
+// touch MMIO are translated, and a block is cut short at the first instruction that can't
+// be, so the interpreter picks up from there exactly where the native code left off.
+class Recompiler {
+public:
+    static constexpr size_t CODE_BUFFER_SIZE = 4 * 1024 * 1024;
+    static constexpr size_t MAX_NATIVE_BLOCKS = 16384;
+
+    explicit Recompiler(Bus& bus) : bus(bus) {}
+    ~Recompiler();
+
+    Recompiler(const Recompiler&) = delete;
+    Recompiler& operator=(const Recompiler&) = delete;
+
+    [[nodiscard]] static bool Supported();
+
+    // Allocates the executable code buffer. Returns false if the host doesn't allow it.
+    bool Init();
+
+    // Returns nullptr if the first instruction in the block can't be translated
+    const NativeBlock* Compile(const DecodedBlock& block);
+
+    // Bumped every time the code buffer is flushed, which invalidates every NativeBlock
+    [[nodiscard]] u32 Epoch() const { return epoch; }
+
+private:
+    class Emitter;
+
+    bool CanTranslate(const DecodedInstruction& inst);
+    void Flush();
+
+    Bus& bus;
+
+    u8* code{};
+    size_t code_used{};
+    std::array<NativeBlock, MAX_NATIVE_BLOCKS> blocks{};
+    size_t blocks_used{};
+    u32 epoch{1};
+
+    std::vector<u8> scratch{};
+};
+
+#endif //BRUTENES_RECOMPILER_H
@@ -0,0 +1,47 @@
+
+#ifndef BRUTENES_RENDERPOOL_H
+#define BRUTENES_RENDERPOOL_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+// A fixed set of worker threads that each run one band of a job. Only one job is in flight
+// at a time, and the thread that starts it is the only one that waits on it.
+class RenderPool {
+public:
+    // Runs band `band` of `bands`, on one of the workers
+    using Job = std::function<void(u32 band, u32 bands)>;
+
+    explicit RenderPool(u32 workers);
+    ~RenderPool();
+
+    RenderPool(const RenderPool&) = delete;
+    RenderPool& operator=(const RenderPool&) = delete;
+
+    // Hands every worker its band of job. The last job has to be waited on first.
+    void Start(Job job);
+    // Blocks until every band of the current job is done. Returns right away if there isn't one.
+    void Wait();
+
+    [[nodiscard]] u32 Workers() const { return (u32)threads.size(); }
+
+private:
+    void WorkerLoop(u32 band);
+
+    std::vector<std::thread> threads{};
+    std::mutex mutex{};
+    std::condition_variable start_cv{};
+    std::condition_variable done_cv{};
+    Job job{};
+    // Bumped for every job so each worker runs it exactly once
+    u64 job_generation{};
+    u32 bands_left{};
+    bool stop_signal{};
+};
+
+#endif //BRUTENES_RENDERPOOL_H
@@ -13,6 +13,9 @@ enum class InterruptSource {
     NMI,
     APU,
     External,
+    // A PPU status change the CPU can see, such as vblank ending or sprite 0 hitting. It doesn't
+    // interrupt anything, it's only there so CPU blocks stop right on it.
+    PPUStatus,
 };
 
 struct Interrupt {
@@ -22,7 +25,7 @@ struct Interrupt {
     bool recurring;
 };
 
-bool CompareInterrupt(Interrupt a, Interrupt b);
+bool CompareInterrupt(const Interrupt& a, const Interrupt& b);
 
 class Scheduler {
 public:
@@ -39,6 +42,8 @@ public:
     explicit Scheduler(CPU& cpu) : cpu(cpu) {}
 
     void ScheduleInterrupt(s32 cycle_count, InterruptSource source, bool recurring = false);
+    // Posts a one off event at an absolute master clock cycle
+    void ScheduleAt(u64 cycles, InterruptSource source);
 
     [[nodiscard]] s64 CPUCyclesTillInterrupt() const;
 
@@ -52,7 +57,7 @@ public:
 
     u32 frame_count{};
 
-    std::priority_queue<Interrupt, std::vector<Interrupt>, decltype(&CompareInterrupt)> queue{};
+    std::priority_queue<Interrupt, std::vector<Interrupt>, decltype(&CompareInterrupt)> queue{&CompareInterrupt};
 
 private:
     CPU& cpu;
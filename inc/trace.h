@@ -0,0 +1,97 @@
+
+#ifndef BRUTENES_TRACE_H
+#define BRUTENES_TRACE_H
+
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+
+// One executed instruction, captured right before it runs
+struct TraceRecord {
+    // Master clock cycle the instruction started on
+    u64 cycle;
+    u16 pc;
+    u16 operand;
+    u8 opcode;
+    u8 a;
+    u8 x;
+    u8 y;
+    u8 sp;
+    u8 p;
+    u8 padding[6]{};
+};
+static_assert(sizeof(TraceRecord) == 24);
+
+[[nodiscard]] std::string_view OpcodeName(u8 opcode);
+
+// Streams trace records to a file from a background thread. The emulator thread only
+// copies each record into a single producer single consumer ring, and the writer thread
+// compresses them by XORing every record with the one before it and run length encoding
+// the zero bytes that leaves, since most fields barely change between instructions.
+class TraceWriter {
+public:
+    static constexpr char MAGIC[8] = {'B', 'N', 'T', 'R', 'A', 'C', 'E', '1'};
+    static constexpr size_t RING_SIZE = 1 << 20;
+
+    TraceWriter();
+    ~TraceWriter();
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool Open(const std::string& path);
+    // Flushes everything still in the ring and closes the file
+    void Close();
+
+    inline void Push(const TraceRecord& record) {
+        const auto head = write_index.load(std::memory_order_relaxed);
+        // If the writer falls behind, wait for it rather than drop records
+        while (head - read_index.load(std::memory_order_acquire) >= RING_SIZE) {
+            std::this_thread::yield();
+        }
+        ring[head & (RING_SIZE - 1)] = record;
+        write_index.store(head + 1, std::memory_order_release);
+    }
+
+private:
+    void WriterLoop();
+    void Compress(const TraceRecord& record);
+
+    std::unique_ptr<TraceRecord[]> ring;
+    alignas(64) std::atomic<u64> write_index{};
+    alignas(64) std::atomic<u64> read_index{};
+
+    std::FILE* file{};
+    std::thread writer{};
+    std::atomic<bool> stop_signal{};
+
+    // Writer thread state
+    std::array<u8, sizeof(TraceRecord)> previous{};
+    std::vector<u8> out{};
+    u8 zero_run{};
+};
+
+// Reads back a file written by TraceWriter one record at a time
+class TraceReader {
+public:
+    ~TraceReader();
+
+    bool Open(const std::string& path);
+    bool Next(TraceRecord& record);
+
+private:
+    int ReadByte();
+
+    std::FILE* file{};
+    std::array<u8, sizeof(TraceRecord)> previous{};
+    u8 zero_run{};
+};
+
+#endif //BRUTENES_TRACE_H
@@ -9,6 +9,12 @@
 
 #include "common.h"
 
+// The PDEP packed row expansion is only picked at runtime if the host supports BMI2, so all
+// it needs is a compiler that can target it
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BRUTENES_VIRTMEM_BMI2 1
+#endif
+
 class INES;
 
 class FakeVirtualMemory {
@@ -20,6 +26,8 @@ public:
     static constexpr auto MAX_PRG_SIZE = 8 * 1024 * 1024;
     static constexpr auto MAX_CHR_SIZE = 8 * 1024 * 1024;
     static constexpr auto CIRAM_SIZE = 0x800;
+    static constexpr auto NAMETABLE_COUNT = 4;
+    static constexpr auto ATTRIBUTE_OFFSET = 0x3c0;
 
     enum Tag : u8 {
         Unmapped = 0,
@@ -28,9 +36,81 @@ public:
         MMIO     = 1 << 2,
     };
 
+    // How decoded CHR tiles are kept around for the renderer
+    enum class PixelCache {
+        // One byte per pixel
+        Bytes,
+        // 2 bits per pixel, 8 pixels to a u16, expanded to bytes on lookup
+        Packed,
+    };
+
     void InitCPUMap(std::span<u8> prg);
     void InitPPUMap(std::span<u8> chr, const INES& header);
 
+    // Points a CPU bank window at new memory. Anything cached from the old mapping is
+    // stale afterwards, so this bumps the generation of every window it affects.
+    void MapCPUBank(u16 addr, u8* mem, u8 tag);
+
+    // Windows that map the same memory (the CIRAM mirrors) share one write counter, so a
+    // write through any of them is seen through all of them
+    constexpr void MarkCPUWritten(u32 bank) {
+        cpu_write_generation[cpu_write_alias[bank]]++;
+    }
+
+    // Changes whenever the window is written to or remapped. Only compare it against an
+    // earlier value from the same window.
+    [[nodiscard]] inline u64 CPUPageGeneration(u32 bank) const {
+        return (u64)cpu_map_generation[bank] << 32 | cpu_write_generation[cpu_write_alias[bank]];
+    }
+
+    // Index of the 16 byte CHR tile at offset in a pattern table window
+    [[nodiscard]] inline u32 CHRTileIndex(u32 bank, u16 offset) const {
+        return (ppumem[bank] + offset - chr.data()) / 16;
+    }
+    [[nodiscard]] inline bool CHRTileDirty(u32 tile) const {
+        return (chr_tile_dirty[tile / 64] & (1ull << (tile % 64))) != 0;
+    }
+    inline void MarkCHRWritten(u32 bank, u16 offset) {
+        const auto tile = CHRTileIndex(bank, offset);
+        chr_tile_dirty[tile / 64] |= 1ull << (tile % 64);
+    }
+    // Decodes a tile into the active pixel cache and clears its dirty bit
+    void DecodeCHRTile(u32 tile);
+    // Frees the old cache and allocates the new one. Every tile is decoded again into it the
+    // next time it's used.
+    void SetPixelCache(PixelCache mode);
+
+    // Spreads a packed_pixel_cache row out to one pixel per byte
+    [[nodiscard]] inline u64 ExpandPackedRow(u16 packed) const {
+#ifdef BRUTENES_VIRTMEM_BMI2
+        if (packed_row_pdep) {
+            return ExpandPackedRowBMI2(packed);
+        }
+#endif
+        // Halve the distance between the pixels three times, 8 to 4 to 2 to 1 pixel apart
+        u64 row = packed;
+        row = (row | row << 24) & 0x000000ff000000ffull;
+        row = (row | row << 12) & 0x000f000f000f000full;
+        row = (row | row << 6) & 0x0303030303030303ull;
+        return row;
+    }
+#ifdef BRUTENES_VIRTMEM_BMI2
+    static u64 ExpandPackedRowBMI2(u16 packed);
+#endif
+
+    // Palette (0-3) of each of the 32 tiles in a nametable row, decoded from the attribute
+    // table. bank is the PPU window the nametable is mapped in.
+    const u8* NametableRowPalettes(u32 bank, u8 coarse_y);
+
+    // Attribute writes only mark the four rows they cover, which are decoded again the
+    // next time the renderer asks for them
+    inline void MarkNametableWritten(u32 bank, u16 offset) {
+        if (offset < ATTRIBUTE_OFFSET)
+            return;
+        const auto index = (ppumem[bank] - nmt.data()) / BANK_WINDOW;
+        nmt_dirty_rows[index] |= 0xfu << ((offset - ATTRIBUTE_OFFSET) / 8 * 4);
+    }
+
 //    void Reserve(u32 size);
 //
 //    std::span<u8> CreateView(u32 offset, u32 size);
@@ -40,15 +120,36 @@ public:
     std::array<u8*, BANK_COUNT> cpumem{};
     std::array<u8, BANK_COUNT> pputag{};
     std::array<u8*, BANK_COUNT> ppumem{};
-    std::array<u8*, BANK_COUNT> chr_pixel_map{};
+
+    // Lowest window that maps the same memory as this one, which owns the shared write counter
+    std::array<u8, BANK_COUNT> cpu_write_alias{};
+    std::array<u32, BANK_COUNT> cpu_write_generation{};
+    std::array<u32, BANK_COUNT> cpu_map_generation{};
 
     std::array<u8, CIRAM_SIZE> ciram{};
     int prg_bank_count{};
     int chr_bank_count{};
     std::array<u8, MAX_PRG_SIZE> prg{};
     std::array<u8, MAX_CHR_SIZE> chr{};
-    std::array<u8, MAX_CHR_SIZE * 4> decoded_pixel_cache{};
-    std::array<u8, 0x400 * 4> nmt{};
+    // Bytes of CHR ROM or RAM the game has, which the pixel caches are sized from
+    u32 chr_size{};
+    // Only the cache picked by pixel_cache is allocated, and the other one is left empty.
+    // Each tile is 64 bytes, 8 pixels to a row.
+    std::vector<u8> decoded_pixel_cache{};
+    // Each row of a tile as 2 bit pixels, leftmost pixel in the low bits. A quarter the size
+    // of decoded_pixel_cache, so the tiles in use stay in cache.
+    std::vector<u16> packed_pixel_cache{};
+    PixelCache pixel_cache = PixelCache::Bytes;
+    // Set when packed rows are expanded with PDEP, if the host has BMI2
+    bool packed_row_pdep{};
+    // One bit per CHR tile that has to be decoded again before it's used
+    std::array<u64, MAX_CHR_SIZE / 16 / 64> chr_tile_dirty{};
+    std::array<u8, 0x400 * NAMETABLE_COUNT> nmt{};
+    // Decoded attribute table of each physical nametable, one palette per tile. The 32 rows
+    // include the two past the visible 30 since coarse Y can be scrolled into them.
+    std::array<u8, 32 * 32 * NAMETABLE_COUNT> nmt_palette{};
+    // One bit per row of nmt_palette that has to be decoded again before it's used
+    std::array<u32, NAMETABLE_COUNT> nmt_dirty_rows{};
 
 //    std::array<std::array<u8, BANK_WINDOW>, MAX_PRG_SIZE / BANK_WINDOW> prg{};
 //    std::array<std::array<u8, BANK_WINDOW>, MAX_CHR_SIZE / BANK_WINDOW> chr{};
@@ -0,0 +1,398 @@
+#include <chrono>
+#include <fstream>
+#include <iostream>
+
+#include <argparse/argparse.hpp>
+
+#include "brutenes.h"
+
+// A loop the benchmarks run over and over, and what one iteration of it costs
+struct BenchLoop {
+    std::vector<u8> code;
+    u32 instructions;
+    u32 cycles;
+};
+
+// Straight line arithmetic and logic that sets N and Z on nearly every instruction, without
+// any branches or register accesses
+static BenchLoop ALULoop() {
+    return BenchLoop{
+        .code = {
+            0xa5, 0x00,       // LDA $00
+            0x18,             // CLC
+            0x69, 0x37,       // ADC #$37
+            0x45, 0x01,       // EOR $01
+            0x29, 0x7f,       // AND #$7F
+            0x05, 0x02,       // ORA $02
+            0x38,             // SEC
+            0xe9, 0x11,       // SBC #$11
+            0xc9, 0x40,       // CMP #$40
+            0x85, 0x00,       // STA $00
+            0xaa,             // TAX
+            0xe8,             // INX
+            0x8a,             // TXA
+            0x0a,             // ASL
+            0x4a,             // LSR
+            0x4c, 0x00, 0x80, // JMP $8000
+        },
+        .instructions = 16,
+        .cycles = 37,
+    };
+}
+
+// An NROM image with 32KB of PRG and 8KB of blank CHR. The code goes at $8000, which every
+// vector points at.
+static std::vector<u8> MakeNROM(const std::vector<u8>& code) {
+    constexpr u32 PRG_SIZE = 0x8000;
+    constexpr u32 CHR_SIZE = 0x2000;
+    std::vector<u8> rom(0x10 + PRG_SIZE + CHR_SIZE);
+    const std::array<u8, 6> header = {'N', 'E', 'S', 0x1a, PRG_SIZE / 0x4000, CHR_SIZE / 0x2000};
+    std::copy(header.begin(), header.end(), rom.begin());
+    u8* prg = &rom[0x10];
+    std::copy(code.begin(), code.end(), prg);
+    for (const u16 vector : {CPU::NMIVector, CPU::ResetVector, CPU::IRQVector}) {
+        prg[vector - 0x8000] = 0x00;
+        prg[vector - 0x8000 + 1] = 0x80;
+    }
+    return rom;
+}
+
+// Wall clock nanoseconds per call of run, after a few untimed calls to warm the caches up
+template <typename Fn>
+static double TimePerCall(u32 calls, Fn run) {
+    using Clock = std::chrono::steady_clock;
+    for (u32 i = 0; i < std::min<u32>(calls / 10, 60); i++) {
+        run();
+    }
+    const auto start = Clock::now();
+    for (u32 i = 0; i < calls; i++) {
+        run();
+    }
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count() / calls;
+}
+
+// PPU register writes mixed in with RAM accesses, for the paths that catch the PPU up or log
+// the write instead
+static BenchLoop PPUWriteLoop() {
+    return BenchLoop{
+        .code = {
+            0xa9, 0x00,       // LDA #$00
+            0x8d, 0x03, 0x20, // STA $2003
+            0x8d, 0x05, 0x20, // STA $2005
+            0x8d, 0x05, 0x20, // STA $2005
+            0xa5, 0x00,       // LDA $00
+            0x18,             // CLC
+            0x69, 0x01,       // ADC #$01
+            0x85, 0x00,       // STA $00
+            0x4c, 0x00, 0x80, // JMP $8000
+        },
+        .instructions = 9,
+        .cycles = 27,
+    };
+}
+
+// Reaches into the emulator for the benchmarks that time one part of it on its own
+class Benchmarks {
+public:
+    static int ALU(u32 frames);
+    static int Interpreter(u32 frames);
+    static int Dispatch(const std::string& romfile, u32 frames);
+    static int Sprites(u32 frames);
+    static int Render(u32 frames);
+
+private:
+    // Same as BruteNES::RunFrame without the interrupts, running the interpreter specialization
+    // picked by use_ppu_log and CPU::instrumented
+    static void RunCPUFrame(BruteNES& nes, bool use_ppu_log);
+    // Draws every visible line of a frame the way RunFastScanline does, with no scrolling
+    static void RenderFrame(PPU& ppu);
+    // Sprite evaluation the way it ran before the per line buckets, scanning all of OAM for
+    // every visible line, into the same tables PPU::BuildOAMBuckets fills
+    static void ScanOAMPerLine(PPU& ppu);
+};
+
+// Whole frames of the ALU loop. Rendering and NMIs are never turned on, so nearly all of the
+// time is the interpreter.
+int Benchmarks::ALU(u32 frames) {
+    const auto loop = ALULoop();
+    auto nes = BruteNES::Init(MakeNROM(loop.code));
+    nes->ColdBoot();
+    const double frame_ns = TimePerCall(frames, [&] { nes->RunFrame(); });
+    const double instructions = (double)Scheduler::NTSC_CPU_CLOCK * loop.instructions / loop.cycles;
+#ifdef BRUTENES_LAZY_FLAGS
+    constexpr auto flags = "lazy";
+#else
+    constexpr auto flags = "eager";
+#endif
+    fmt::print("alu: {} flags, {:.1f} us/frame, {:.2f} ns/instruction\n",
+               flags, frame_ns / 1000, frame_ns / instructions);
+    return 0;
+}
+
+void Benchmarks::RunCPUFrame(BruteNES& nes, bool use_ppu_log) {
+    const u32 frame = nes.timing.frame_count;
+    while (frame == nes.timing.frame_count) {
+        nes.cpu.RunFor(std::max<s64>(nes.timing.CPUCyclesTillInterrupt(), 1), use_ppu_log);
+        nes.ppu.CatchUp();
+    }
+}
+
+// Per instruction cost of each interpreter specialization. With instrumentation on and nothing
+// attached, all that's left of the hooks is checking for a tracer and a profiler on every
+// instruction, which is what the other specialization compiles out.
+int Benchmarks::Interpreter(u32 frames) {
+    const std::array<std::pair<const char*, BenchLoop>, 2> loops = {{
+        {"alu", ALULoop()},
+        {"ppu writes", PPUWriteLoop()},
+    }};
+    for (const auto& [name, loop] : loops) {
+        const double instructions = (double)Scheduler::NTSC_CPU_CLOCK * loop.instructions / loop.cycles;
+        fmt::print("interpreter: {} loop\n", name);
+        for (const bool use_ppu_log : {false, true}) {
+            for (const bool instrument : {false, true}) {
+                auto nes = BruteNES::Init(MakeNROM(loop.code));
+                nes->ColdBoot();
+                nes->cpu.instrumented = instrument;
+                const double frame_ns = TimePerCall(frames, [&] { RunCPUFrame(*nes, use_ppu_log); });
+                fmt::print("  register log {:<3}  hooks {:<12}  {:7.1f} us/frame {:6.2f} ns/instruction\n",
+                           use_ppu_log ? "on" : "off", instrument ? "checked" : "compiled out",
+                           frame_ns / 1000, frame_ns / instructions);
+            }
+        }
+    }
+    return 0;
+}
+
+// How many handler dispatches instruction fusion saves on a real game. Frames are run through
+// the normal frame loop with the profiler attached, so the recompiler and idle loop skipping
+// stay out of it the same way they do when profiling.
+int Benchmarks::Dispatch(const std::string& romfile, u32 frames) {
+    std::ifstream instream(romfile, std::ios::binary);
+    std::vector<u8> file_contents((std::istreambuf_iterator<char>(instream)), std::istreambuf_iterator<char>());
+    auto nes = BruteNES::Init(std::move(file_contents));
+    if (!nes) {
+        return 1;
+    }
+    nes->StartProfiler();
+    nes->ColdBoot();
+    for (u32 i = 0; i < frames; i++) {
+        nes->RunFrame();
+    }
+    const u64 instructions = nes->profiler->Instructions();
+    const u64 dispatches = nes->profiler->Dispatches();
+    fmt::print("dispatch: {:.0f} instructions/frame, {:.0f} dispatches/frame, {:.1f}% saved by fusion\n",
+               (double)instructions / frames, (double)dispatches / frames,
+               instructions ? 100.0 * (instructions - dispatches) / instructions : 0.0);
+    return 0;
+}
+
+void Benchmarks::ScanOAMPerLine(PPU& ppu) {
+    const u8 sprite_size = ppu.ctrl.sp_size ? 16 : 8;
+    for (u16 line = 0; line < PPU::SCANLINE_VBLANK_START; line++) {
+        u8 written = 0;
+        u16 n = 0;
+        for (; n < 256 && written < 8; n += 4) {
+            const u8 y = ppu.OAM[n];
+            if (line >= y && line < y + sprite_size) {
+                ppu.line_sprites[line][written++] = n;
+            }
+        }
+        ppu.line_sprite_count[line] = written;
+        ppu.line_sprite_overflow[line] = written == 8 && ppu.EvaluateSpriteOverflow(line, n, sprite_size);
+    }
+}
+
+// Cost of finding the sprites on every line of a frame, scanning OAM once per line against
+// dropping each sprite into per line buckets once. OAM is treated as changing every frame, as
+// it does in games that DMA a new page each vblank, so the buckets are rebuilt every time.
+int Benchmarks::Sprites(u32 frames) {
+    auto nes = BruteNES::Init(MakeNROM(ALULoop().code));
+    PPU& ppu = nes->ppu;
+
+    std::array<u8, 256> spread{};
+    std::array<u8, 256> clustered{};
+    for (u16 i = 0; i < 64; i++) {
+        // Spread evenly down the screen, at most two sprites on a line
+        spread[i * 4] = i * 240 / 64;
+        spread[i * 4 + 3] = i * 4;
+        // Rows of 16 sprites side by side, which fill every line they cover and make the
+        // overflow scan run
+        clustered[i * 4] = 40 + (i / 16) * 48;
+        clustered[i * 4 + 3] = (i % 16) * 16;
+    }
+    const std::array<std::pair<const char*, const std::array<u8, 256>*>, 2> layouts = {{
+        {"spread", &spread},
+        {"clustered", &clustered},
+    }};
+
+    for (const auto& [name, oam] : layouts) {
+        for (const u8 sp_size : {0, 1}) {
+            ppu.OAM = *oam;
+            ppu.ctrl.sp_size = sp_size;
+
+            const double scan_ns = TimePerCall(frames, [&] { ScanOAMPerLine(ppu); });
+            const auto scanned_sprites = ppu.line_sprites;
+            const auto scanned_count = ppu.line_sprite_count;
+            const auto scanned_overflow = ppu.line_sprite_overflow;
+
+            const double bucket_ns = TimePerCall(frames, [&] { ppu.BuildOAMBuckets(); });
+            bool same = scanned_count == ppu.line_sprite_count && scanned_overflow == ppu.line_sprite_overflow;
+            for (u16 line = 0; same && line < PPU::SCANLINE_VBLANK_START; line++) {
+                same = std::equal(scanned_sprites[line].begin(), scanned_sprites[line].begin() + scanned_count[line],
+                                  ppu.line_sprites[line].begin());
+            }
+
+            fmt::print("sprites: {:<9} 8x{:<2}  scan {:7.2f} us/frame  buckets {:7.2f} us/frame{}\n",
+                       name, sp_size ? 16 : 8, scan_ns / 1000, bucket_ns / 1000, same ? "" : "  MISMATCH");
+            if (!same) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+void Benchmarks::RenderFrame(PPU& ppu) {
+    for (u16 line = 0; line < PPU::SCANLINE_VBLANK_START; line++) {
+        ppu.scanline = line;
+        ppu.v = (line & 7) << 12 | (line / 8) << 5;
+        ppu.RenderScanlineSpan(0, 256);
+        ppu.FastOAMEvaluation();
+    }
+}
+
+// Cost of drawing a frame out of each pixel cache. The pattern tables are noise and every
+// nametable entry is a different tile than its neighbours, with 64 sprites of every flip down
+// the screen, so most of the CHR is looked up every frame. Every cache has to draw the same
+// pixels as the first one.
+int Benchmarks::Render(u32 frames) {
+    auto nes = BruteNES::Init(MakeNROM(ALULoop().code));
+    PPU& ppu = nes->ppu;
+    FakeVirtualMemory& mmu = nes->bus.fakemmu;
+
+    u32 seed = 1;
+    for (u32 i = 0; i < 0x2000; i++) {
+        seed = seed * 1664525 + 1013904223;
+        mmu.chr[i] = seed >> 24;
+    }
+    for (u32 i = 0; i < mmu.nmt.size(); i++) {
+        mmu.nmt[i] = i * 7;
+    }
+    mmu.nmt_dirty_rows.fill(~0u);
+    for (u8 i = 0; i < ppu.palette.size(); i++) {
+        ppu.palette[i] = i;
+    }
+    for (u16 i = 0; i < 64; i++) {
+        ppu.OAM[i * 4] = i * 3;
+        ppu.OAM[i * 4 + 1] = i;
+        ppu.OAM[i * 4 + 2] = (i & 3) << 6 | (i & 3);
+        ppu.OAM[i * 4 + 3] = i * 4;
+    }
+    ppu.oam_buckets_dirty = true;
+    ppu.ctrl.sp_pattern = 1;
+    ppu.mask.raw = 0x1e;
+
+    struct Mode {
+        const char* name;
+        FakeVirtualMemory::PixelCache cache;
+        bool pdep;
+    };
+    const std::array<Mode, 3> modes = {{
+        {"bytes", FakeVirtualMemory::PixelCache::Bytes, false},
+        {"packed", FakeVirtualMemory::PixelCache::Packed, false},
+        {"packed pdep", FakeVirtualMemory::PixelCache::Packed, true},
+    }};
+    std::vector<u16> expected{};
+    for (const auto& mode : modes) {
+        nes->SetPixelCache(mode.cache);
+        if (mode.pdep && !mmu.packed_row_pdep) {
+            fmt::print("render: {:<12} not supported on this host\n", mode.name);
+            continue;
+        }
+        mmu.packed_row_pdep = mode.pdep;
+
+        const double frame_ns = TimePerCall(frames, [&] { RenderFrame(ppu); });
+        const std::vector<u16> pixels(ppu.rendering_to, ppu.rendering_to + 256 * PPU::SCANLINE_VBLANK_START);
+        if (expected.empty()) {
+            expected = pixels;
+        }
+        fmt::print("render: {:<12} {:7.1f} us/frame{}\n", mode.name, frame_ns / 1000,
+                   pixels == expected ? "" : "  MISMATCH");
+        if (pixels != expected) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    argparse::ArgumentParser program("brutenes-bench");
+
+    argparse::ArgumentParser alu("alu");
+    alu.add_description("interpreter cost on ALU heavy code, build with and without BRUTENES_LAZY_FLAGS to compare");
+    alu.add_argument("-f", "--frames")
+        .help("number of frames to time")
+        .scan<'u', u32>()
+        .default_value((u32)2000);
+    program.add_subparser(alu);
+
+    argparse::ArgumentParser interpreter("interpreter");
+    interpreter.add_description("per instruction cost of each interpreter specialization");
+    interpreter.add_argument("-f", "--frames")
+        .help("number of frames to time for each one")
+        .scan<'u', u32>()
+        .default_value((u32)1000);
+    program.add_subparser(interpreter);
+
+    argparse::ArgumentParser dispatch("dispatch");
+    dispatch.add_description("instructions and handler dispatches per frame of a game, to see what fusion saves");
+    dispatch.add_argument("romfile");
+    dispatch.add_argument("-f", "--frames")
+        .help("number of frames to run")
+        .scan<'u', u32>()
+        .default_value((u32)600);
+    program.add_subparser(dispatch);
+
+    argparse::ArgumentParser sprites("sprites");
+    sprites.add_description("finding each line's sprites with a scan of OAM per line against per line buckets");
+    sprites.add_argument("-f", "--frames")
+        .help("number of frames to time for each one")
+        .scan<'u', u32>()
+        .default_value((u32)20000);
+    program.add_subparser(sprites);
+
+    argparse::ArgumentParser render("render");
+    render.add_description("drawing a frame out of each pixel cache");
+    render.add_argument("-f", "--frames")
+        .help("number of frames to time for each one")
+        .scan<'u', u32>()
+        .default_value((u32)2000);
+    program.add_subparser(render);
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    if (program.is_subcommand_used("alu")) {
+        return Benchmarks::ALU(alu.get<u32>("--frames"));
+    }
+    if (program.is_subcommand_used("interpreter")) {
+        return Benchmarks::Interpreter(interpreter.get<u32>("--frames"));
+    }
+    if (program.is_subcommand_used("dispatch")) {
+        return Benchmarks::Dispatch(dispatch.get("romfile"), dispatch.get<u32>("--frames"));
+    }
+    if (program.is_subcommand_used("sprites")) {
+        return Benchmarks::Sprites(sprites.get<u32>("--frames"));
+    }
+    if (program.is_subcommand_used("render")) {
+        return Benchmarks::Render(render.get<u32>("--frames"));
+    }
+    std::cerr << program;
+    return 1;
+}
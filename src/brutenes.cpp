@@ -1,4 +1,5 @@
 
+#include <algorithm>
 #include <chrono>
 #include <range/v3/view.hpp>
 
@@ -31,18 +32,12 @@ void BruteNES::RunFrame() {
     u32 current_frame = timing.frame_count;
     ppu.SwapBuffer();
     while (!stop_signal.load(std::memory_order_acquire)) {
-        u32 estimate = timing.CPUCyclesTillInterrupt();
-        bool use_ppu_cache = false;
-        if (ppu.status.vblank) {
-            // If we are in vblank, then its safe to use the write cache
-            s64 estimate_adjustment = (s64)20 * PPU::CYCLES_PER_SCANLINE - (ppu.scanline * PPU::CYCLES_PER_SCANLINE + ppu.cycle);
-            if (estimate_adjustment > 0) {
-                estimate = estimate_adjustment / Scheduler::NTSC_CPU_CLOCK_DIVIDER;
-                use_ppu_cache = true;
-            }
-        }
-        u32 count = cpu.RunFor(estimate, use_ppu_cache);
-        timing.AddCPUCycles(count);
+        // The PPU posts every vblank and sprite 0 change as an event, so the block runs right up
+        // to the next thing the CPU could see change
+        u32 estimate = std::max<s64>(timing.CPUCyclesTillInterrupt(), 1);
+        // Register writes are logged with their cycle and applied on the right dot when the PPU
+        // next catches up, so they don't need to sync at any point in the frame
+        cpu.RunFor(estimate, true);
         ppu.CatchUp();
 
         // Check for the IRQ flag to see if we need to run the 7 cycle IRQ handle
@@ -50,7 +45,7 @@ void BruteNES::RunFrame() {
             if (ppu.ctrl.nmi != 0) {
                 cpu.PushStack(cpu.PC >> 8);
                 cpu.PushStack(cpu.PC & 0xff);
-                cpu.PushStack(cpu.P);
+                cpu.PushStack(cpu.GetP());
                 cpu.PC = bus.Read16(CPU::NMIVector);
                 cpu.SetFlag<CPU::Flags::I>(true);
                 timing.AddCPUCycles(7);
@@ -60,7 +55,7 @@ void BruteNES::RunFrame() {
         if (cpu.pending_irq && (cpu.P & CPU::Flags::I) == 0) {
             cpu.PushStack(cpu.PC >> 8);
             cpu.PushStack(cpu.PC & 0xff);
-            cpu.PushStack(cpu.P);
+            cpu.PushStack(cpu.GetP());
             cpu.PC = bus.Read16(CPU::IRQVector);
             cpu.SetFlag<CPU::Flags::I>(true);
             timing.AddCPUCycles(7);
@@ -73,17 +68,46 @@ void BruteNES::RunFrame() {
 }
 
 void BruteNES::ColdBoot() {
-    // Setup vblank interval timer
-    timing.ScheduleInterrupt(Scheduler::NTSC_CLOCK_PER_FRAME, InterruptSource::NMI, true);
+    // Nothing has run yet, so this only posts the first vblank events
+    ppu.CatchUp();
     cpu.Reset();
 }
 
-u16* BruteNES::GetFrame() {
-    if (paused) {
-        return prev_frame;
+bool BruteNES::SetCPUBackend(CPU::Backend backend) {
+    return cpu.SetBackend(backend);
+}
+
+void BruteNES::SetPixelCache(FakeVirtualMemory::PixelCache mode) {
+    bus.SetPixelCache(mode);
+}
+
+void BruteNES::SetRenderThreads(u32 workers) {
+    ppu.SetRenderThreads(workers);
+}
+
+bool BruteNES::StartTrace(const std::string& path) {
+    tracer = std::make_unique<TraceWriter>();
+    if (!tracer->Open(path)) {
+        tracer.reset();
+        return false;
     }
-    prev_frame = ppu.LockBuffer();
-    return prev_frame;
+    cpu.SetTrace(tracer.get());
+    return true;
+}
+
+void BruteNES::StartProfiler() {
+    profiler = std::make_unique<Profiler>();
+    cpu.SetProfiler(profiler.get());
+}
+
+void BruteNES::PrintProfile(std::FILE* out) const {
+    if (profiler)
+        profiler->Report(out);
+}
+
+PPU::Frame BruteNES::GetFrame() {
+    // While paused nothing new is published, so this keeps returning the last frame
+    return ppu.LatestFrame();
 }
 
 void BruteNES::RunLoop() {
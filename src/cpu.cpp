@@ -1,16 +1,30 @@
 
 #include <signal.h>
+#include <algorithm>
+#include <numeric>
 #include "cpu.h"
 #include "bus.h"
+#include "profiler.h"
+#include "trace.h"
 
-#define TRACE_LOG() \
-    SPDLOG_INFO("${:4X}: {} ${:X} a${:2x} x${:2x} y${:2x} SP${:2x} P${:2x} -> {} @ ${:4X}", \
-                prev_pc, inst_name_lut[prev_idx], operand, \
-                cpu.A, cpu.X, cpu.Y, cpu.SP, cpu.P, \
-                inst_name_lut[inst_idx], cpu.PC);
+#define TRACE_LOG()                                                                      \
+    if constexpr (Instrument) {                                                         \
+        inst_pc = cpu.PC;                                                               \
+        if (tracer) {                                                                   \
+            tracer->Push(TraceRecord{                                                   \
+                .cycle = timing.cycle_count                                             \
+                    + (u64)(current_cycles - committed_cycles) * Scheduler::NTSC_CPU_CLOCK_DIVIDER, \
+                .pc = cpu.PC, .operand = cur->operand, .opcode = cur->opcode,           \
+                .a = cpu.A, .x = cpu.X, .y = cpu.Y, .sp = cpu.SP, .p = cpu.GetP(),      \
+            });                                                                         \
+        }                                                                               \
+    }
 
-#undef TRACE_LOG
-#define TRACE_LOG() ;
+#define PROFILE(call)                                                                    \
+    if constexpr (Instrument) {                                                         \
+        if (profiler)                                                                   \
+            profiler->call;                                                             \
+    }
 
 
 void CPU::Reset() {
@@ -18,15 +32,38 @@ void CPU::Reset() {
     PC = bus.Read16(ResetVector);
 //    PC = 0xc000;
     SP = 0xfd;
-    P = 0x34;
+    SetP(0x34);
     A = 0;
     X = 0;
     Y = 0;
 }
 
-u32 CPU::RunFor(u64 cycles, bool use_ppu_cache) {
-    u32 count = interpreter.RunBlock(cycles, use_ppu_cache);
-    return count;
+u32 CPU::RunFor(u64 cycles, bool use_ppu_log) {
+    // Pick the interpreter specialization once here so the hot path doesn't have to check
+    if (use_ppu_log) {
+        return instrumented ? interpreter.RunBlock<true, true>(cycles) : interpreter.RunBlock<true, false>(cycles);
+    }
+    return instrumented ? interpreter.RunBlock<false, true>(cycles) : interpreter.RunBlock<false, false>(cycles);
+}
+
+void CPU::SetTrace(TraceWriter* writer) {
+    interpreter.SetTracer(writer);
+    tracer = writer;
+    instrumented = tracer || profiler;
+}
+
+void CPU::SetProfiler(Profiler* prof) {
+    interpreter.SetProfiler(prof);
+    profiler = prof;
+    instrumented = tracer || profiler;
+}
+
+bool CPU::SetBackend(Backend backend) {
+    if (!interpreter.EnableRecompiler(backend == Backend::Recompiler)) {
+        SPDLOG_WARN("Recompiler is not supported on this host, falling back to the interpreter");
+        return false;
+    }
+    return true;
 }
 
 // Copied from https://github.com/bheisler/Corrosion/blob/5ca2b3a03825c3d58623df774a8596de32b46812/src/cpu/mod.rs#L356
@@ -49,41 +86,27 @@ static std::array<u8, 256> cycle_lut = {
     /*0xF0*/ 2,5,2,8,4,4,6,6,2,4,2,7,4,4,7,7,
 };
 
+// Instruction length in bytes (opcode + operand) for each addressing mode
+static std::array<u8, 256> length_lut = {
+    /*0x00*/ 2,2,1,2,2,2,2,2,1,2,1,2,3,3,3,3,
+    /*0x10*/ 2,2,1,2,2,2,2,2,1,3,1,3,3,3,3,3,
+    /*0x20*/ 3,2,1,2,2,2,2,2,1,2,1,2,3,3,3,3,
+    /*0x30*/ 2,2,1,2,2,2,2,2,1,3,1,3,3,3,3,3,
+    /*0x40*/ 1,2,1,2,2,2,2,2,1,2,1,2,3,3,3,3,
+    /*0x50*/ 2,2,1,2,2,2,2,2,1,3,1,3,3,3,3,3,
+    /*0x60*/ 1,2,1,2,2,2,2,2,1,2,1,2,3,3,3,3,
+    /*0x70*/ 2,2,1,2,2,2,2,2,1,3,1,3,3,3,3,3,
+    /*0x80*/ 2,2,2,2,2,2,2,2,1,2,1,2,3,3,3,3,
+    /*0x90*/ 2,2,1,2,2,2,2,2,1,3,1,3,3,3,3,3,
+    /*0xA0*/ 2,2,2,2,2,2,2,2,1,2,1,2,3,3,3,3,
+    /*0xB0*/ 2,2,1,2,2,2,2,2,1,3,1,3,3,3,3,3,
+    /*0xC0*/ 2,2,2,2,2,2,2,2,1,2,1,2,3,3,3,3,
+    /*0xD0*/ 2,2,1,2,2,2,2,2,1,3,1,3,3,3,3,3,
+    /*0xE0*/ 2,2,2,2,2,2,2,2,1,2,1,2,3,3,3,3,
+    /*0xF0*/ 2,2,1,2,2,2,2,2,1,3,1,3,3,3,3,3,
+};
+
 
-static std::array<std::string, 256> inst_name_lut = {{
-        "BRK_IMM", "ORA_INX", "STP_IMP", "SLO_INX", "NOP_ZPA", "ORA_ZPA", "ASL_ZPA", "SLO_ZPA",
-        "PHP_IMP", "ORA_IMM", "ASL_IMP", "ANC_IMM", "NOP_ABS", "ORA_ABS", "ASL_ABS", "SLO_ABS",
-        "BPL_REL", "ORA_INY", "STP_IMP", "SLO_INY", "NOP_ZPX", "ORA_ZPX", "ASL_ZPX", "SLO_ZPX",
-        "CLC_IMP", "ORA_ABY", "NOP_IMP", "SLO_ABY", "NOP_ABX", "ORA_ABX", "ASL_ABX", "SLO_ABX",
-        "JSR_ABS", "AND_INX", "STP_IMP", "RLA_INX", "BIT_ZPA", "AND_ZPA", "ROL_ZPA", "RLA_ZPA",
-        "PLP_IMP", "AND_IMM", "ROL_IMP", "ANC_IMM", "BIT_ABS", "AND_ABS", "ROL_ABS", "RLA_ABS",
-        "BMI_REL", "AND_INY", "STP_IMP", "RLA_INY", "NOP_ZPX", "AND_ZPX", "ROL_ZPX", "RLA_ZPX",
-        "SEC_IMP", "AND_ABY", "NOP_IMP", "RLA_ABY", "NOP_ABX", "AND_ABX", "ROL_ABX", "RLA_ABX",
-        "RTI_IMP", "EOR_INX", "STP_IMP", "SRE_INX", "NOP_ZPA", "EOR_ZPA", "LSR_ZPA", "SRE_ZPA",
-        "PHA_IMP", "EOR_IMM", "LSR_IMP", "ALR_IMM", "JMP_ABS", "EOR_ABS", "LSR_ABS", "SRE_ABS",
-        "BVC_REL", "EOR_INY", "STP_IMP", "SRE_INY", "NOP_ZPX", "EOR_ZPX", "LSR_ZPX", "SRE_ZPX",
-        "CLI_IMP", "EOR_ABY", "NOP_IMP", "SRE_ABY", "NOP_ABX", "EOR_ABX", "LSR_ABX", "SRE_ABX",
-        "RTS_IMP", "ADC_INX", "STP_IMP", "RRA_INX", "NOP_ZPA", "ADC_ZPA", "ROR_ZPA", "RRA_ZPA",
-        "PLA_IMP", "ADC_IMM", "ROR_IMP", "ARR_IMM", "JMP_IND", "ADC_ABS", "ROR_ABS", "RRA_ABS",
-        "BVS_REL", "ADC_INY", "STP_IMP", "RRA_INY", "NOP_ZPX", "ADC_ZPX", "ROR_ZPX", "RRA_ZPX",
-        "SEI_IMP", "ADC_ABY", "NOP_IMP", "RRA_ABY", "NOP_ABX", "ADC_ABX", "ROR_ABX", "RRA_ABX",
-        "NOP_IMM", "STA_INX", "NOP_IMM", "SAX_INX", "STY_ZPA", "STA_ZPA", "STX_ZPA", "SAX_ZPA",
-        "DEY_IMP", "NOP_IMM", "TXA_IMP", "XAA_IMM", "STY_ABS", "STA_ABS", "STX_ABS", "SAX_ABS",
-        "BCC_REL", "STA_INY", "STP_IMP", "AHX_INY", "STY_ZPX", "STA_ZPX", "STX_ZPY", "SAX_ZPY",
-        "TYA_IMP", "STA_ABY", "TXS_IMP", "TAS_ABY", "SHY_ABX", "STA_ABX", "SHX_ABY", "AHX_ABY",
-        "LDY_IMM", "LDA_INX", "LDX_IMM", "LAX_INX", "LDY_ZPA", "LDA_ZPA", "LDX_ZPA", "LAX_ZPA",
-        "TAY_IMP", "LDA_IMM", "TAX_IMP", "LAX_IMM", "LDY_ABS", "LDA_ABS", "LDX_ABS", "LAX_ABS",
-        "BCS_REL", "LDA_INY", "STP_IMP", "LAX_INY", "LDY_ZPX", "LDA_ZPX", "LDX_ZPY", "LAX_ZPY",
-        "CLV_IMP", "LDA_ABY", "TSX_IMP", "LAS_ABY", "LDY_ABX", "LDA_ABX", "LDX_ABY", "LAX_ABY",
-        "CPY_IMM", "CMP_INX", "NOP_IMM", "DCP_INX", "CPY_ZPA", "CMP_ZPA", "DEC_ZPA", "DCP_ZPA",
-        "INY_IMP", "CMP_IMM", "DEX_IMP", "AXS_IMM", "CPY_ABS", "CMP_ABS", "DEC_ABS", "DCP_ABS",
-        "BNE_REL", "CMP_INY", "STP_IMP", "DCP_INY", "NOP_ZPX", "CMP_ZPX", "DEC_ZPX", "DCP_ZPX",
-        "CLD_IMP", "CMP_ABY", "NOP_IMP", "DCP_ABY", "NOP_ABX", "CMP_ABX", "DEC_ABX", "DCP_ABX",
-        "CPX_IMM", "SBC_INX", "NOP_IMM", "ISC_INX", "CPX_ZPA", "SBC_ZPA", "INC_ZPA", "ISC_ZPA",
-        "INX_IMP", "SBC_IMM", "NOP_IMP", "SBC_IMM", "CPX_ABS", "SBC_ABS", "INC_ABS", "ISC_ABS",
-        "BEQ_REL", "SBC_INY", "STP_IMP", "ISC_INY", "NOP_ZPX", "SBC_ZPX", "INC_ZPX", "ISC_ZPX",
-        "SED_IMP", "SBC_ABY", "NOP_IMP", "ISC_ABY", "NOP_ABX", "SBC_ABX", "INC_ABX", "ISC_ABX",
-}};
 
 
 // I'm so sorry.
@@ -92,74 +115,139 @@ static std::array<std::string, 256> inst_name_lut = {{
 #define NOOP16(inner) u16 value = inner;
 //#define READ8(inner) u8 value = bus.Read8(inner);
 
+// Commits the cycles up to the current bus access to the scheduler and catches the PPU up,
+// so the register access happens on the exact cycle it would on hardware. Reads and writes
+// land on the last cycle of the instruction.
+#define SYNC_MMIO_ACCESS() {                                             \
+    u32 access_cycle = current_cycles + cycle_lut[inst_idx] - 1;         \
+    timing.AddCPUCycles(access_cycle - committed_cycles);               \
+    committed_cycles = access_cycle;                                     \
+    bus.CatchUpPPU();                                                    \
+    PROFILE(MMIOSync(inst_pc))                                           \
+}
+
+// Master clock cycle the bus access of the current instruction lands on, without committing it
+#define MMIO_ACCESS_CYCLE() (timing.cycle_count                                                  \
+    + (u64)(current_cycles + cycle_lut[inst_idx] - 1 - committed_cycles) * Scheduler::NTSC_CPU_CLOCK_DIVIDER)
+
+// Status polls can usually be answered without catching the PPU up, so those only sync
+// when the prediction can't be made
 #define CHECKED_READ_8(inner) u8 value; {   \
     if (!bus.CheckedRead8(inner, value)) {       \
-        if (current_cycles != 0)                 \
-            goto MMIO;                           \
-        if (inner >= 0x2000 && inner < 0x4000) { \
+        if ((inner & 0xe007) == 0x2002 && bus.PredictPPUStatusRead(MMIO_ACCESS_CYCLE(), value)) { \
+            PROFILE(PredictedStatusRead(inst_pc)) \
+        } else if (inner >= 0x2000 && inner < 0x4000) { \
+            SYNC_MMIO_ACCESS()                   \
             value = bus.ReadPPURegister(inner); \
         } else if (inner >= 0x4000 && inner < 0x4018) { \
+            SYNC_MMIO_ACCESS()                   \
             value = bus.ReadAPURegister(inner); \
         } else {                                \
             /* TODO mapper MMIO */              \
+            SYNC_MMIO_ACCESS()                   \
             value = bus.OpenBus();              \
         }                                       \
     }                                           \
 }
 
 #define CHECKED_WRITE_8(inner, value) {   \
-    if (!bus.CheckedWrite8(inner, value)) {  \
+    const u8 write_value = (value);          \
+    if (!bus.CheckedWrite8(inner, write_value)) {  \
         if (inner >= 0x2000 && inner < 0x4000) { \
-            if (!use_ppu_cache && current_cycles != 0) { \
-                /* write can't happen until the PPU is caught up*/ \
-                goto MMIO;                       \
-            }                                    \
-            bus.WritePPURegister(inner, value, use_ppu_cache); \
+            if constexpr (!UsePPUCache)          \
+                SYNC_MMIO_ACCESS()               \
+            bus.WritePPURegister(inner, write_value, UsePPUCache, MMIO_ACCESS_CYCLE()); \
         } else if (inner >= 0x4000 && inner < 0x4018) { \
-            /*the only write we can't support is starting dmc*/ \
-            if ((value & 0x10) && inner == 0x4015) { \
-                goto MMIO;                         \
-            } else if (inner == 0x4014) { \
-                oam_value = value; \
-                goto OAMDMA;                          \
-            }                                     \
-            bus.WriteAPURegister(inner, value, true); \
-        } else {                            \
-            goto MMIO;                      \
-        }                                   \
-    }                                       \
+            if (inner == 0x4014) {               \
+                oam_value = write_value;         \
+                goto OAMDMA;                     \
+            }                                    \
+            /* DMC DMA isn't emulated, so starting it is a plain register write */ \
+            bus.WriteAPURegister(inner, write_value, true); \
+        }                                        \
+        /* Only NROM is supported, which has no registers of its own, so anything else is dropped */ \
+    }                                            \
 }
 
-#define FETCH_NEXT {                        \
-        u8 prev_idx = inst_idx;             \
-        {                                   \
-            CHECKED_READ_8(cpu.PC)              \
-            inst_idx = value;                   \
-        }                                   \
-        TRACE_LOG();                        \
-        prev_pc = cpu.PC++;                 \
+// Instructions come from the predecoded block cache, so the operand bytes
+// have already been read and the PC skips over the whole instruction here.
+#define FETCH_NEXT {                                \
+        if (next == block_end) {                    \
+            /* Cache slots are reused and every uncached block is the same scratch one, so a */ \
+            /* loop only goes around again if it starts over at the same PC in the same page */ \
+            const bool same_start = block != nullptr && block->pc == cpu.PC \
+                && block->page == bus.DirectCPUPageAccess(cpu.PC); \
+            DecodedBlock* prev_block = block;       \
+            block = LookupBlock(cpu.PC, inst_lut);  \
+            if (same_start && block == prev_block && block->idle != DecodedBlock::IdleLoop::None) { \
+                if (++idle_iterations >= 2) {       \
+                    u32 skipped = IdleLoopSkip(*block, current_cycles, committed_cycles, max_cycles); \
+                    current_cycles += skipped;      \
+                    PROFILE(IdleSkip(block->pc, skipped)) \
+                }                                   \
+            } else {                                \
+                idle_iterations = 0;                \
+            }                                       \
+            if (!Instrument && use_recompiler)      \
+                block = RunNative(block, current_cycles, max_cycles, inst_lut); \
+            next = block->code.data();              \
+            block_end = next + block->count;        \
+        }                                           \
+        cur = next++;                               \
+        inst_idx = cur->opcode;                     \
+        TRACE_LOG();                                \
+        cpu.PC += cur->length;                      \
     }
 
 
 #define PAGE_CROSS_CHECK(reg) (((operand + cpu.reg) & 0xff) < cpu.reg)
 
 #define GOTO_NEXT(page_crossed) {                                  \
-        current_cycles += cycle_lut[inst_idx] + page_crossed;      \
+        u32 inst_cycles = cycle_lut[inst_idx] + page_crossed;      \
+        PROFILE(Instruction(inst_pc, inst_idx, inst_cycles))       \
+        current_cycles += inst_cycles;                             \
         if (current_cycles >= max_cycles)                          \
             goto END;                                              \
         FETCH_NEXT                                                 \
-        goto* inst_lut[inst_idx];                                  \
+        PROFILE(Dispatch())                                        \
+        goto* cur->handler;                                        \
+    }
+
+// Ends the first half of a fused pair by starting the second instruction with a direct jump
+// to its label. The budget is still checked in between, so a pair can be split across two
+// calls and stop on exactly the same cycle it would have without fusion.
+#define FUSED_NEXT(second) {                                       \
+        u32 inst_cycles = cycle_lut[inst_idx];                     \
+        PROFILE(Instruction(inst_pc, inst_idx, inst_cycles))       \
+        current_cycles += inst_cycles;                             \
+        if (current_cycles >= max_cycles)                          \
+            goto END;                                              \
+        cur = next++;                                              \
+        inst_idx = cur->opcode;                                    \
+        TRACE_LOG();                                               \
+        cpu.PC += cur->length;                                     \
+        goto second;                                               \
     }
 
+// ADC of operand_value into A, which SBC also uses with the operand inverted
+#define ADD_WITH_CARRY(operand_value) {                            \
+    const u8 addend = operand_value;                               \
+    u8 carry_out;                                                  \
+    u8 result = __builtin_addcb(cpu.A, addend, cpu.P & 1, &carry_out); \
+    cpu.SetFlag<CPU::Flags::C>(carry_out);                         \
+    cpu.SetFlag<CPU::Flags::V>((~(cpu.A ^ addend) & (cpu.A ^ result) & 0x80) != 0); \
+    cpu.SetNZ(result);                                             \
+    cpu.A = result;                                                \
+}
+
 #define COMPARE_OP(reg) { \
     cpu.SetFlag<CPU::Flags::C>(reg >= value);                      \
-    cpu.SetFlag<CPU::Flags::Z>(reg == value);                \
-    cpu.SetFlag<CPU::Flags::N>(((reg - value) & 0x80) != 0 );      \
+    cpu.SetNZ(reg - value);                                        \
 }
 
 #define DECODE_REL(name, condition)                                \
 name##_REL: {                                                      \
-        operand = bus.Read8(cpu.PC++);                             \
+        operand = cur->operand;                                    \
         u8 penalty = 0;                                            \
         if (condition) {                                           \
             u16 oldPC = cpu.PC;                                    \
@@ -175,38 +263,35 @@ name##_IMP: {                                    \
     }
 #define DECODE_IMM(name, OP, code)               \
 name##_IMM: {                                    \
-        operand = bus.Read8(cpu.PC++);           \
+        operand = cur->operand;                  \
         OP(operand)                              \
         code                                     \
         GOTO_NEXT(0)                             \
     }
 #define DECODE_ABS(name, OP, code)               \
 name##_ABS: {                                    \
-        operand = bus.Read16(cpu.PC);            \
-        cpu.PC += 2;                             \
+        operand = cur->operand;                  \
         OP(operand)                              \
         code                                     \
         GOTO_NEXT(0)                             \
     }
 #define DECODE_ABX(name, OP, code, page_cross)   \
 name##_ABX: {                                    \
-        operand = bus.Read16(cpu.PC) + cpu.X;    \
-        cpu.PC += 2;                             \
+        operand = cur->operand + cpu.X;          \
         OP(operand)                              \
         code                                     \
         GOTO_NEXT(page_cross)                    \
     }
 #define DECODE_ABY(name, OP, code, page_cross)   \
 name##_ABY: {                                    \
-        operand = bus.Read16(cpu.PC) + cpu.Y;    \
-        cpu.PC += 2;                             \
+        operand = cur->operand + cpu.Y;          \
         OP(operand)                              \
         code                                     \
         GOTO_NEXT(page_cross)                    \
     }
 #define DECODE_INX(name, OP, code)               \
 name##_INX: {                                    \
-        operand = (u8)(bus.Read8(cpu.PC++) + cpu.X);   \
+        operand = (u8)(cur->operand + cpu.X);    \
         if ((operand & 0xff) == 0xff) {          \
             u8 lo = bus.Read8(operand);          \
             u8 hi = bus.Read8(operand - 0xff);   \
@@ -220,7 +305,7 @@ name##_INX: {                                    \
     }
 #define DECODE_INY(name, OP, code, page_cross)   \
 name##_INY: {                                    \
-        operand = bus.Read8(cpu.PC++);           \
+        operand = cur->operand;                  \
         if ((operand & 0xff) == 0xff) {          \
             u8 lo = bus.Read8(0xff);             \
             u8 hi = bus.Read8(0);                \
@@ -235,32 +320,50 @@ name##_INY: {                                    \
     }
 #define DECODE_ZPA(name, OP, code)               \
 name##_ZPA: {                                    \
-        operand = bus.Read8(cpu.PC++);           \
+        operand = cur->operand;                  \
         OP(operand)                              \
         code                                     \
         GOTO_NEXT(0)                             \
     }
 #define DECODE_ZPX(name, OP, code)               \
 name##_ZPX: {                                    \
-        operand = (u8)(bus.Read8(cpu.PC++) + cpu.X);   \
+        operand = (u8)(cur->operand + cpu.X);    \
         OP(operand)                              \
         code                                     \
         GOTO_NEXT(0)                             \
     }
+#define DECODE_FUSED(name, second, OP, code)     \
+name##_##second: {                               \
+        operand = cur->operand;                  \
+        OP(operand)                              \
+        code                                     \
+        FUSED_NEXT(second)                       \
+    }
 #define DECODE_ZPY(name, OP, code)               \
 name##_ZPY: {                                    \
-        operand = (u8)(bus.Read8(cpu.PC++) + cpu.Y);   \
+        operand = (u8)(cur->operand + cpu.Y);    \
         OP(operand)                              \
         code                                     \
         GOTO_NEXT(0)                             \
     }
 
-u32 Interpreter::RunBlock(u32 max_cycles, bool use_ppu_cache) {
+template <bool UsePPUCache, bool Instrument>
+u32 Interpreter::RunBlock(u32 max_cycles) {
 
     u32 current_cycles = 0;
-    u16 operand;
+    // Cycles already added to the scheduler by an MMIO access
+    u32 committed_cycles = 0;
+    // Number of times in a row the current block has branched back to itself
+    u32 idle_iterations = 0;
+    // Address of the instruction being run, only tracked when tracing or profiling
+    u16 inst_pc{};
+    u16 operand{};
     u8 oam_value;
     u8 inst_idx{};
+    DecodedBlock* block{};
+    const DecodedInstruction* cur{};
+    const DecodedInstruction* next{};
+    const DecodedInstruction* block_end{};
 
 /*
 0x00   BRK         ORA (d,x)   STP         SLO (d,x)   NOP d       ORA d       ASL d       SLO d
@@ -296,7 +399,7 @@ u32 Interpreter::RunBlock(u32 max_cycles, bool use_ppu_cache) {
 0xf0   BEQ *+d     SBC (d),y   STP         ISC (d),y   NOP d,x     SBC d,x     INC d,x     ISC d,x
 0xf8   SED         SBC a,y     NOP         ISC a,y     NOP a,x     SBC a,x     INC a,x     ISC a,x
 */
-    static std::array<void*, 256> inst_lut = {
+    static HandlerTable inst_lut = {
         &&BRK_IMM, &&ORA_INX, &&STP_IMP, &&SLO_INX, &&NOP_ZPA, &&ORA_ZPA, &&ASL_ZPA, &&SLO_ZPA,
         &&PHP_IMP, &&ORA_IMM, &&ASL_IMP, &&ANC_IMM, &&NOP_ABS, &&ORA_ABS, &&ASL_ABS, &&SLO_ABS,
         &&BPL_REL, &&ORA_INY, &&STP_IMP, &&SLO_INY, &&NOP_ZPX, &&ORA_ZPX, &&ASL_ZPX, &&SLO_ZPX,
@@ -329,22 +432,32 @@ u32 Interpreter::RunBlock(u32 max_cycles, bool use_ppu_cache) {
         &&INX_IMP, &&SBC_IMM, &&NOP_IMP, &&SBC_IMM, &&CPX_ABS, &&SBC_ABS, &&INC_ABS, &&ISC_ABS,
         &&BEQ_REL, &&SBC_INY, &&STP_IMP, &&ISC_INY, &&NOP_ZPX, &&SBC_ZPX, &&INC_ZPX, &&ISC_ZPX,
         &&SED_IMP, &&SBC_ABY, &&NOP_IMP, &&ISC_ABY, &&NOP_ABX, &&SBC_ABX, &&INC_ABX, &&ISC_ABX,
+        // Fused pairs, in the same order as fused_pairs
+        &&CMP_IMM_BNE_REL, &&CMP_IMM_BEQ_REL, &&CMP_ZPA_BNE_REL, &&CMP_ZPA_BEQ_REL,
+        &&CPX_IMM_BNE_REL, &&CPY_IMM_BNE_REL,
+        &&DEX_IMP_BNE_REL, &&DEY_IMP_BNE_REL, &&INX_IMP_BNE_REL, &&INY_IMP_BNE_REL,
+        &&INC_ZPA_BNE_REL, &&DEC_ZPA_BNE_REL,
+        &&LDA_IMM_STA_ZPA, &&LDA_ZPA_STA_ZPA,
+        &&CLC_IMP_ADC_IMM, &&CLC_IMP_ADC_ZPA, &&SEC_IMP_SBC_IMM,
+        &&ADC_IMM_STA_ZPA, &&ADC_ZPA_STA_ZPA, &&SBC_IMM_STA_ZPA,
+        // Fused triples, in the same order as fused_triples
+        &&CLC_IMP_ADC_IMM_STA_ZPA, &&CLC_IMP_ADC_ZPA_STA_ZPA, &&SEC_IMP_SBC_IMM_STA_ZPA,
+        &&LDA_ZPA_CMP_IMM_BNE_REL, &&LDA_ZPA_CMP_IMM_BEQ_REL,
     };
 
     // Start the interpreter
     FETCH_NEXT
-    goto* inst_lut[inst_idx];
+    PROFILE(Dispatch())
+    goto* cur->handler;
 
     // Control OPCODES
     DECODE_IMP(NOP, {})
     DECODE_ZPA(BIT, CHECKED_READ_8, {
-        cpu.SetFlag<CPU::Flags::Z>((cpu.A & (value)) == 0);
-        cpu.SetFlag<CPU::Flags::N>((value & (CPU::Flags::N)) != 0);
+        cpu.SetZN(cpu.A & value, value);
         cpu.SetFlag<CPU::Flags::V>((value & (CPU::Flags::V)) != 0);
     })
     DECODE_ABS(BIT, CHECKED_READ_8, {
-        cpu.SetFlag<CPU::Flags::Z>((cpu.A & (value)) == 0);
-        cpu.SetFlag<CPU::Flags::N>((value & (CPU::Flags::N)) != 0);
+        cpu.SetZN(cpu.A & value, value);
         cpu.SetFlag<CPU::Flags::V>((value & (CPU::Flags::V)) != 0);
     })
     DECODE_IMM(BRK, NOOP, { cpu.pending_irq = true; goto END; })
@@ -354,7 +467,7 @@ u32 Interpreter::RunBlock(u32 max_cycles, bool use_ppu_cache) {
         cpu.PC = addr + 1;
     })
     DECODE_IMP(RTI, {
-        cpu.P = cpu.PopStack();
+        cpu.SetP(cpu.PopStack());
         u16 addr = cpu.PopStack();
         addr |= cpu.PopStack() << 8;
         cpu.PC = addr;
@@ -366,8 +479,8 @@ u32 Interpreter::RunBlock(u32 max_cycles, bool use_ppu_cache) {
     DECODE_IMP(TYA, { cpu.A = cpu.Y; cpu.SetNZ(cpu.A); })
     DECODE_IMP(TSX, { cpu.X = cpu.SP; cpu.SetNZ(cpu.X); })
     DECODE_IMP(TXS, { cpu.SP = cpu.X; })
-    DECODE_IMP(PHP, { cpu.PushStack(cpu.P | CPU::Flags::B | CPU::Flags::U); })
-    DECODE_IMP(PLP, { cpu.P = cpu.PopStack() & ~(CPU::Flags::B | CPU::Flags::U); })
+    DECODE_IMP(PHP, { cpu.PushStack(cpu.GetP() | CPU::Flags::B | CPU::Flags::U); })
+    DECODE_IMP(PLP, { cpu.SetP(cpu.PopStack() & ~(CPU::Flags::B | CPU::Flags::U)); })
     DECODE_IMP(PHA, { cpu.PushStack(cpu.A); })
     DECODE_IMP(PLA, { cpu.A = cpu.PopStack(); cpu.SetNZ(cpu.A); })
 
@@ -379,14 +492,14 @@ u32 Interpreter::RunBlock(u32 max_cycles, bool use_ppu_cache) {
     DECODE_IMP(SED, { cpu.SetFlag<CPU::Flags::D>(true); })
     DECODE_IMP(CLV, { cpu.SetFlag<CPU::Flags::V>(false); })
 
-    DECODE_REL(BNE, ((cpu.P & CPU::Flags::Z) != CPU::Flags::Z))
-    DECODE_REL(BEQ, ((cpu.P & CPU::Flags::Z) == CPU::Flags::Z))
-    DECODE_REL(BCC, ((cpu.P & CPU::Flags::C) != CPU::Flags::C))
-    DECODE_REL(BCS, ((cpu.P & CPU::Flags::C) == CPU::Flags::C))
-    DECODE_REL(BPL, ((cpu.P & CPU::Flags::N) != CPU::Flags::N))
-    DECODE_REL(BMI, ((cpu.P & CPU::Flags::N) == CPU::Flags::N))
-    DECODE_REL(BVC, ((cpu.P & CPU::Flags::V) != CPU::Flags::V))
-    DECODE_REL(BVS, ((cpu.P & CPU::Flags::V) == CPU::Flags::V))
+    DECODE_REL(BNE, !cpu.GetFlag<CPU::Flags::Z>())
+    DECODE_REL(BEQ, cpu.GetFlag<CPU::Flags::Z>())
+    DECODE_REL(BCC, !cpu.GetFlag<CPU::Flags::C>())
+    DECODE_REL(BCS, cpu.GetFlag<CPU::Flags::C>())
+    DECODE_REL(BPL, !cpu.GetFlag<CPU::Flags::N>())
+    DECODE_REL(BMI, cpu.GetFlag<CPU::Flags::N>())
+    DECODE_REL(BVC, !cpu.GetFlag<CPU::Flags::V>())
+    DECODE_REL(BVS, cpu.GetFlag<CPU::Flags::V>())
     DECODE_ABS(JSR, NOOP, {
         cpu.PushStack((cpu.PC-1) >> 8 );
         cpu.PushStack((cpu.PC-1) & 0xff );
@@ -396,7 +509,7 @@ u32 Interpreter::RunBlock(u32 max_cycles, bool use_ppu_cache) {
         cpu.PC = operand;
     })
     JMP_IND: {
-        operand = bus.Read16(cpu.PC);
+        operand = cur->operand;
 
         if ((operand & 0xFF) == 0xFF) {
             u8 lo = bus.Read8(operand);
@@ -433,12 +546,7 @@ u32 Interpreter::RunBlock(u32 max_cycles, bool use_ppu_cache) {
         cpu.SetNZ(cpu.A);
     })
     ALU_OP(ADC, {
-        u8 carry_out;
-        u8 result = __builtin_addcb(cpu.A, value, cpu.P & 1, &carry_out);
-        cpu.SetFlag<CPU::Flags::C>(carry_out);
-        cpu.SetFlag<CPU::Flags::V>((~(cpu.A ^ value) & (cpu.A ^ result) & 0x80) != 0);
-        cpu.SetNZ(result);
-        cpu.A = (u8)result;
+        ADD_WITH_CARRY(value)
     })
 
     // sta is different from the other ALU ops
@@ -478,12 +586,7 @@ u32 Interpreter::RunBlock(u32 max_cycles, bool use_ppu_cache) {
         COMPARE_OP(cpu.A)
     })
     ALU_OP(SBC, {
-        uint8_t carry_out;
-        uint8_t result = __builtin_addcb(cpu.A, value ^ 0xff, cpu.P & 1, &carry_out);
-        cpu.SetFlag<CPU::Flags::C>(carry_out);
-        cpu.SetFlag<CPU::Flags::V>((~(cpu.A ^ (value ^ 0xff)) & (cpu.A ^ result) & 0x80) != 0);
-        cpu.SetNZ(result);
-        cpu.A = (u8)result;
+        ADD_WITH_CARRY((u8)(value ^ 0xff))
     })
 #define LDX_OP(code) \
     DECODE_IMM(LDX, NOOP8, code) \
@@ -598,6 +701,42 @@ DECODE_ZPX(name, CHECKED_READ_8, code)
         cpu.SetNZ(cpu.Y);
     })
 
+    // Fused pairs. Each runs the same code as the first instruction's own handler and then
+    // falls into the second one's.
+    DECODE_FUSED(CMP_IMM, BNE_REL, NOOP8, { COMPARE_OP(cpu.A) })
+    DECODE_FUSED(CMP_IMM, BEQ_REL, NOOP8, { COMPARE_OP(cpu.A) })
+    DECODE_FUSED(CMP_ZPA, BNE_REL, CHECKED_READ_8, { COMPARE_OP(cpu.A) })
+    DECODE_FUSED(CMP_ZPA, BEQ_REL, CHECKED_READ_8, { COMPARE_OP(cpu.A) })
+    DECODE_FUSED(CPX_IMM, BNE_REL, NOOP8, { COMPARE_OP(cpu.X) })
+    DECODE_FUSED(CPY_IMM, BNE_REL, NOOP8, { COMPARE_OP(cpu.Y) })
+    DECODE_FUSED(DEX_IMP, BNE_REL, NOOP, { cpu.X--; cpu.SetNZ(cpu.X); })
+    DECODE_FUSED(DEY_IMP, BNE_REL, NOOP, { cpu.Y--; cpu.SetNZ(cpu.Y); })
+    DECODE_FUSED(INX_IMP, BNE_REL, NOOP, { cpu.X++; cpu.SetNZ(cpu.X); })
+    DECODE_FUSED(INY_IMP, BNE_REL, NOOP, { cpu.Y++; cpu.SetNZ(cpu.Y); })
+    DECODE_FUSED(INC_ZPA, BNE_REL, CHECKED_READ_8, {
+        CHECKED_WRITE_8(operand, (u8)++value);
+        cpu.SetNZ(value);
+    })
+    DECODE_FUSED(DEC_ZPA, BNE_REL, CHECKED_READ_8, {
+        CHECKED_WRITE_8(operand, (u8)--value);
+        cpu.SetNZ(value);
+    })
+    DECODE_FUSED(LDA_IMM, STA_ZPA, NOOP8, { cpu.A = value; cpu.SetNZ(value); })
+    DECODE_FUSED(LDA_ZPA, STA_ZPA, CHECKED_READ_8, { cpu.A = value; cpu.SetNZ(value); })
+    DECODE_FUSED(CLC_IMP, ADC_IMM, NOOP, { cpu.SetFlag<CPU::Flags::C>(false); })
+    DECODE_FUSED(CLC_IMP, ADC_ZPA, NOOP, { cpu.SetFlag<CPU::Flags::C>(false); })
+    DECODE_FUSED(SEC_IMP, SBC_IMM, NOOP, { cpu.SetFlag<CPU::Flags::C>(true); })
+    DECODE_FUSED(ADC_IMM, STA_ZPA, NOOP8, { ADD_WITH_CARRY(value) })
+    DECODE_FUSED(ADC_ZPA, STA_ZPA, CHECKED_READ_8, { ADD_WITH_CARRY(value) })
+    DECODE_FUSED(SBC_IMM, STA_ZPA, NOOP8, { ADD_WITH_CARRY((u8)(value ^ 0xff)) })
+
+    // Fused triples run the first instruction and then fall into the fused pair for the rest
+    DECODE_FUSED(CLC_IMP, ADC_IMM_STA_ZPA, NOOP, { cpu.SetFlag<CPU::Flags::C>(false); })
+    DECODE_FUSED(CLC_IMP, ADC_ZPA_STA_ZPA, NOOP, { cpu.SetFlag<CPU::Flags::C>(false); })
+    DECODE_FUSED(SEC_IMP, SBC_IMM_STA_ZPA, NOOP, { cpu.SetFlag<CPU::Flags::C>(true); })
+    DECODE_FUSED(LDA_ZPA, CMP_IMM_BNE_REL, CHECKED_READ_8, { cpu.A = value; cpu.SetNZ(value); })
+    DECODE_FUSED(LDA_ZPA, CMP_IMM_BEQ_REL, CHECKED_READ_8, { cpu.A = value; cpu.SetNZ(value); })
+
     // Unofficial Opcodes
 
 #define OP_NOP() \
@@ -626,42 +765,355 @@ DECODE_ZPX(name, CHECKED_READ_8, code)
     LAX_ZPY: {
         GOTO_NEXT(0)
     }
-    ALU_OP(SLO, {})
-    ALU_OP(SRE, {})
-    ALU_OP(LAX, {})
-    ALU_OP(SAX, {})
-    ALU_OP(RRA, {})
-    ALU_OP(DCP, {})
-    ALU_OP(ISC, {})
-    ALU_OP(RLA, {})
-
-OAMDMA:
-    // First determine if we have enough cycles left to run oam dma
-    // before the next breakpoint. DMC DMA is allowed to interrupt OAM DMA
-    // so we can fall back to cycle accurate to resolve that conflict.
-    // TODO actually add the single stepping cpu and remove the current_cycles check here
-    if ((use_ppu_cache || current_cycles == 0) && (max_cycles - current_cycles) > 514) {
-        u8 align_delay = timing.IsGetCycle() ? 0 : 1;
-        for (int i = 0; i < 256; i++) {
-            u8 spr;
-            // TODO OAMDMA can't actually read from registers so it should access the backing
-            // memory directly and ignore MMIO
-            if (!bus.CheckedRead8((oam_value << 8) + i, spr)) {
-                spr = bus.OpenBus();
-            }
-            bus.WritePPURegister(0x2004, spr, use_ppu_cache);
-        }
-        current_cycles += 512 + align_delay;
-        GOTO_NEXT(0)
+    // Still do the read, so a register access has the same side effects. An immediate has
+    // nothing to read, so that one doesn't need the value at all.
+#define UNIMPLEMENTED_ALU_OP(name) \
+    DECODE_IMM(name, NOOP, {}) \
+    DECODE_ABS(name, CHECKED_READ_8, {}) \
+    DECODE_ABX(name, CHECKED_READ_8, {}, PAGE_CROSS_CHECK(X)) \
+    DECODE_ABY(name, CHECKED_READ_8, {}, PAGE_CROSS_CHECK(Y)) \
+    DECODE_INX(name, CHECKED_READ_8, {}) \
+    DECODE_INY(name, CHECKED_READ_8, {}, PAGE_CROSS_CHECK(Y)) \
+    DECODE_ZPA(name, CHECKED_READ_8, {}) \
+    DECODE_ZPX(name, CHECKED_READ_8, {})
+    UNIMPLEMENTED_ALU_OP(SLO)
+    UNIMPLEMENTED_ALU_OP(SRE)
+    UNIMPLEMENTED_ALU_OP(LAX)
+    UNIMPLEMENTED_ALU_OP(SAX)
+    UNIMPLEMENTED_ALU_OP(RRA)
+    UNIMPLEMENTED_ALU_OP(DCP)
+    UNIMPLEMENTED_ALU_OP(ISC)
+    UNIMPLEMENTED_ALU_OP(RLA)
+
+OAMDMA: {
+    // The CPU is halted for the whole transfer, so catch the PPU up to the write
+    // that started it and then copy the page in one go.
+    // DMC DMA isn't emulated, so nothing can interrupt the transfer
+    if constexpr (!UsePPUCache) {
+        SYNC_MMIO_ACCESS()
     }
-    // Fallthrough to MMIO so we step single stepping
+    u8 align_delay = timing.IsGetCycle() ? 0 : 1;
+    // Each byte is a read then a write, so the last write lands at the end of the 512 cycles
+    // after the alignment
+    bus.OAMDMA(oam_value, UsePPUCache, MMIO_ACCESS_CYCLE() + (u64)(align_delay + 512) * Scheduler::NTSC_CPU_CLOCK_DIVIDER);
+    current_cycles += 512 + align_delay;
+    GOTO_NEXT(0)
+}
 
-MMIO:
-    // We hit an MMIO register and the PPU isn't caught up,
-    // so reverse back to the current instruction and catch up the other devices
-    // and then next time it runs, we can read through to the device
-    cpu.PC = prev_pc;
-    SPDLOG_DEBUG("MMIO register read, resetting PC");
 END:
+    PROFILE(BlockExit(inst_pc))
+    timing.AddCPUCycles(current_cycles - committed_cycles);
     return current_cycles;
 }
+
+static inline u32 BlockCacheIndex(const u8* page, u16 pc) {
+    // Mix in the bank so the same PC in two different banks doesn't always collide
+    const auto bank = (u32)((uintptr_t)page / FakeVirtualMemory::BANK_WINDOW);
+    return (pc ^ ((bank * 0x9E3779B1u) >> 20)) & (Interpreter::BLOCK_CACHE_SIZE - 1);
+}
+
+static inline bool EndsBlock(u8 opcode) {
+    // Branches, JSR, RTI, JMP, RTS, JMP (a) and BRK all change the PC
+    return (opcode & 0x1f) == 0x10 || opcode == 0x20 || opcode == 0x40 || opcode == 0x4c
+        || opcode == 0x60 || opcode == 0x6c || opcode == 0x00;
+}
+
+static inline bool WritesMemory(u8 opcode) {
+    // Stores, read modify writes and pushes. The whole $80-$9F range is counted since
+    // it's nearly all stores, and cutting a block early is harmless.
+    return (opcode & 0xe0) == 0x80 || ((opcode & 0x06) == 0x06 && (opcode & 0xc0) != 0x80)
+        || opcode == 0x08 || opcode == 0x48;
+}
+
+u8 Interpreter::FetchCode8(u16 addr) {
+    if ((bus.CPUPageTag(addr) & FakeVirtualMemory::Tag::Read) == 0) {
+        return bus.OpenBus();
+    }
+    return bus.DirectCPUPageAccess(addr)[addr & (FakeVirtualMemory::BANK_WINDOW-1)];
+}
+
+void Interpreter::DecodeBlock(DecodedBlock& block, u16 pc, const HandlerTable& handlers, int max_instructions) {
+    block.page = bus.DirectCPUPageAccess(pc);
+    block.pc = pc;
+    block.handlers = &handlers;
+    block.cycles = 0;
+    block.count = 0;
+    block.generation = bus.CPUPageGeneration(pc);
+    const bool writable = (bus.CPUPageTag(pc) & FakeVirtualMemory::Tag::Write) != 0;
+    while (block.count < max_instructions) {
+        // Only the first instruction of a block is allowed to straddle the end of the page, and
+        // nothing after it may start in the next window, whose writes the block can't see
+        if (block.count != 0 && ((pc & (FakeVirtualMemory::BANK_WINDOW-1)) > FakeVirtualMemory::BANK_WINDOW - 3
+                || (pc & ~(FakeVirtualMemory::BANK_WINDOW-1)) != (block.pc & ~(FakeVirtualMemory::BANK_WINDOW-1)))) {
+            break;
+        }
+        u8 opcode = FetchCode8(pc);
+        u8 length = length_lut[opcode];
+        u16 operand = 0;
+        if (length > 1)
+            operand = FetchCode8(pc + 1);
+        if (length > 2)
+            operand |= FetchCode8(pc + 2) << 8;
+
+        block.code[block.count++] = DecodedInstruction{
+            .handler = handlers[opcode],
+            .operand = operand,
+            .opcode = opcode,
+            .length = length,
+            .cycles = cycle_lut[opcode],
+            .fused = 0,
+        };
+        block.cycles += cycle_lut[opcode];
+        pc += length;
+        if (EndsBlock(opcode)) {
+            break;
+        }
+        // A store can overwrite the rest of a block in RAM, so end it there and let the
+        // next lookup notice the new write generation
+        if (writable && WritesMemory(opcode)) {
+            break;
+        }
+    }
+    FuseInstructions(block, handlers);
+    DetectIdleLoop(block);
+}
+
+struct FusedPair {
+    u8 first;
+    u8 second;
+};
+
+// Instruction pairs that show up back to back often enough to be worth their own handler,
+// mostly loop counters and compares followed by the branch that tests them. Memory operands
+// are all zero page, so no half of a pair can ever be an MMIO access that needs a sync.
+static constexpr std::array<FusedPair, DecodedInstruction::FUSED_PAIRS> fused_pairs = {{
+    {0xc9, 0xd0}, // CMP #i, BNE
+    {0xc9, 0xf0}, // CMP #i, BEQ
+    {0xc5, 0xd0}, // CMP d, BNE
+    {0xc5, 0xf0}, // CMP d, BEQ
+    {0xe0, 0xd0}, // CPX #i, BNE
+    {0xc0, 0xd0}, // CPY #i, BNE
+    {0xca, 0xd0}, // DEX, BNE
+    {0x88, 0xd0}, // DEY, BNE
+    {0xe8, 0xd0}, // INX, BNE
+    {0xc8, 0xd0}, // INY, BNE
+    {0xe6, 0xd0}, // INC d, BNE
+    {0xc6, 0xd0}, // DEC d, BNE
+    {0xa9, 0x85}, // LDA #i, STA d
+    {0xa5, 0x85}, // LDA d, STA d
+    {0x18, 0x69}, // CLC, ADC #i
+    {0x18, 0x65}, // CLC, ADC d
+    {0x38, 0xe9}, // SEC, SBC #i
+    {0x69, 0x85}, // ADC #i, STA d
+    {0x65, 0x85}, // ADC d, STA d
+    {0xe9, 0x85}, // SBC #i, STA d
+}};
+
+struct FusedTriple {
+    u8 first;
+    u8 second;
+    u8 third;
+};
+
+// Longer runs of the same kind, multi byte arithmetic steps and polling a variable for a value.
+// The last two instructions of each are a fused pair of their own, which the handler falls into.
+static constexpr std::array<FusedTriple, DecodedInstruction::FUSED_TRIPLES> fused_triples = {{
+    {0x18, 0x69, 0x85}, // CLC, ADC #i, STA d
+    {0x18, 0x65, 0x85}, // CLC, ADC d, STA d
+    {0x38, 0xe9, 0x85}, // SEC, SBC #i, STA d
+    {0xa5, 0xc9, 0xd0}, // LDA d, CMP #i, BNE
+    {0xa5, 0xc9, 0xf0}, // LDA d, CMP #i, BEQ
+}};
+
+static inline int HandlerIndex(const DecodedInstruction& inst) {
+    return inst.fused ? 256 + inst.fused - 1 : inst.opcode;
+}
+
+void Interpreter::FuseInstructions(DecodedBlock& block, const HandlerTable& handlers) {
+    // Fused runs never overlap, since everything after the first instruction of one is run by
+    // the fused handler and never dispatched to on its own. Triples are tried first so they
+    // win over the pair at their start.
+    for (int i = 0; i + 1 < block.count; i++) {
+        auto& first = block.code[i];
+        const auto& second = block.code[i + 1];
+        if (i + 2 < block.count) {
+            const auto& third = block.code[i + 2];
+            const auto triple = std::find_if(fused_triples.begin(), fused_triples.end(), [&](const FusedTriple& t) {
+                return t.first == first.opcode && t.second == second.opcode && t.third == third.opcode;
+            });
+            if (triple != fused_triples.end()) {
+                first.fused = DecodedInstruction::FUSED_PAIRS + (triple - fused_triples.begin()) + 1;
+                first.handler = handlers[HandlerIndex(first)];
+                i += 2;
+                continue;
+            }
+        }
+        const auto pair = std::find_if(fused_pairs.begin(), fused_pairs.end(), [&](const FusedPair& p) {
+            return p.first == first.opcode && p.second == second.opcode;
+        });
+        if (pair == fused_pairs.end())
+            continue;
+        first.fused = pair - fused_pairs.begin() + 1;
+        first.handler = handlers[HandlerIndex(first)];
+        i++;
+    }
+}
+
+static inline bool IsIdleLoopOpcode(u8 opcode) {
+    switch (opcode) {
+    // LDA, LDX, LDY
+    case 0xa9: case 0xa5: case 0xad:
+    case 0xa2: case 0xa6: case 0xae:
+    case 0xa0: case 0xa4: case 0xac:
+    // CMP, CPX, CPY
+    case 0xc9: case 0xc5: case 0xcd:
+    case 0xe0: case 0xe4: case 0xec:
+    case 0xc0: case 0xc4: case 0xcc:
+    // BIT, NOP
+    case 0x24: case 0x2c:
+    case 0xea:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void Interpreter::DetectIdleLoop(DecodedBlock& block) {
+    block.idle = DecodedBlock::IdleLoop::None;
+    block.idle_cycles = 0;
+    if (block.count == 0) {
+        return;
+    }
+
+    // The block has to end by jumping straight back to its own start
+    const auto& last = block.code[block.count - 1];
+    const u16 end_pc = block.pc + std::accumulate(block.code.begin(), block.code.begin() + block.count, 0,
+                                                  [](int sum, const auto& inst) { return sum + inst.length; });
+    u16 penalty;
+    if ((last.opcode & 0x1f) == 0x10) {
+        if ((u16)(end_pc + (s8)last.operand) != block.pc)
+            return;
+        // Same penalty calculation as DECODE_REL
+        penalty = 1 + ((end_pc & 0xff00) == (block.pc & 0xff00));
+    } else if (last.opcode == 0x4c) {
+        if (last.operand != block.pc)
+            return;
+        penalty = 0;
+    } else {
+        return;
+    }
+
+    // Everything else has to be a load, compare or BIT. Those only ever set registers from
+    // memory, so after the first pass through the loop each iteration is identical.
+    bool reads_status = false;
+    for (int i = 0; i < block.count - 1; i++) {
+        const auto& inst = block.code[i];
+        if (!IsIdleLoopOpcode(inst.opcode)) {
+            return;
+        }
+        if (inst.length == 1 || (inst.length == 2 && (inst.opcode & 0x04) == 0)) {
+            // NOP or an immediate operand
+            continue;
+        }
+        const u16 addr = inst.length == 2 ? (u8)inst.operand : inst.operand;
+        if ((bus.CPUPageTag(addr) & FakeVirtualMemory::Tag::MMIO) == 0) {
+            continue;
+        }
+        // The only register allowed is a $2002 read right before a BPL/BMI, since then the
+        // branch only depends on the vblank flag
+        const bool status_poll = (addr & 0xe007) == 0x2002 && (inst.opcode == 0xad || inst.opcode == 0x2c);
+        if (!status_poll || i != block.count - 2 || (last.opcode != 0x10 && last.opcode != 0x30)) {
+            return;
+        }
+        reads_status = true;
+    }
+    block.idle = reads_status ? DecodedBlock::IdleLoop::PPUStatus : DecodedBlock::IdleLoop::Memory;
+    block.idle_cycles = block.cycles + penalty;
+}
+
+u32 Interpreter::IdleLoopSkip(const DecodedBlock& block, u32 current_cycles, u32 committed_cycles, u32 max_cycles) {
+    // Leave at least one real iteration before the budget runs out so the loop exits normally
+    if (current_cycles + block.idle_cycles >= max_cycles) {
+        return 0;
+    }
+    u32 iterations = (max_cycles - current_cycles - 1) / block.idle_cycles;
+    if (block.idle == DecodedBlock::IdleLoop::PPUStatus) {
+        // The PPU knows when vblank next changes from wherever it is, even if the last $2002
+        // read was predicted and didn't catch it up
+        const u64 now = timing.cycle_count + (u64)(current_cycles - committed_cycles) * Scheduler::NTSC_CPU_CLOCK_DIVIDER;
+        const u64 edge = bus.NextVBlankEdge();
+        if (edge <= now) {
+            return 0;
+        }
+        const u64 until_edge = (edge - now) / Scheduler::NTSC_CPU_CLOCK_DIVIDER / block.idle_cycles;
+        // Stop an iteration early so the poll that sees the change runs for real
+        if (until_edge <= 1) {
+            return 0;
+        }
+        iterations = std::min<u64>(iterations, until_edge - 1);
+    }
+    return iterations * block.idle_cycles;
+}
+
+DecodedBlock* Interpreter::LookupBlock(u16 pc, const HandlerTable& handlers) {
+    const u8* page = bus.DirectCPUPageAccess(pc);
+    // An instruction at the end of a page depends on two mappings, so decode those one at a time instead
+    if (page == nullptr || (pc & (FakeVirtualMemory::BANK_WINDOW-1)) > FakeVirtualMemory::BANK_WINDOW - 3) {
+        DecodeBlock(uncached_block, pc, handlers, 1);
+        return &uncached_block;
+    }
+
+    // Code running out of writable memory can be modified at any time, so those blocks are
+    // only reused while nothing has written to their page since they were decoded
+    auto& block = block_cache[BlockCacheIndex(page, pc)];
+    const bool writable = (bus.CPUPageTag(pc) & FakeVirtualMemory::Tag::Write) != 0;
+    if (block.page != page || block.pc != pc || (writable && bus.CPUPageChangedSince(pc, block.generation))) {
+        DecodeBlock(block, pc, handlers, DecodedBlock::MAX_INSTRUCTIONS);
+        block.native = nullptr;
+        block.native_epoch = 0;
+    } else if (block.handlers != &handlers) {
+        // Decoded by a different interpreter specialization, so point it at our labels
+        for (int i = 0; i < block.count; i++) {
+            block.code[i].handler = handlers[HandlerIndex(block.code[i])];
+        }
+        block.handlers = &handlers;
+    }
+    return &block;
+}
+
+bool Interpreter::EnableRecompiler(bool enable) {
+    if (enable && (!Recompiler::Supported() || !recompiler.Init())) {
+        use_recompiler = false;
+        return false;
+    }
+    use_recompiler = enable;
+    return true;
+}
+
+DecodedBlock* Interpreter::RunNative(DecodedBlock* block, u32& current_cycles, u32 max_cycles, const HandlerTable& handlers) {
+    // Code in writable memory is never translated, and idle loops are left to the
+    // interpreter so they can be skipped over
+    while (block != &uncached_block && block->idle == DecodedBlock::IdleLoop::None
+            && (bus.CPUPageTag(block->pc) & FakeVirtualMemory::Tag::Write) == 0) {
+        if (block->native_epoch != recompiler.Epoch()) {
+            block->native = recompiler.Compile(*block);
+            block->native_epoch = recompiler.Epoch();
+        }
+        // The interpreter stops as soon as the budget runs out, so only run a native
+        // block when every instruction in it would have finished before that point
+        if (block->native == nullptr || current_cycles + block->native->max_cycles >= max_cycles) {
+            break;
+        }
+        GuestState state{cpu.A, cpu.X, cpu.Y, cpu.GetP(), cpu.PC, bus.DirectCPUPageAccess(0)};
+        current_cycles += block->native->entry(&state);
+        if (block->native->written_windows != 0)
+            bus.MarkCPUWindowsWritten(block->native->written_windows);
+        cpu.A = state.A;
+        cpu.X = state.X;
+        cpu.Y = state.Y;
+        cpu.SetP(state.P);
+        cpu.PC = state.PC;
+        block = LookupBlock(cpu.PC, handlers);
+    }
+    return block;
+}
@@ -69,16 +69,19 @@ public:
         if (win)
             SDL_DestroyWindow(win);
     }
-    void DrawFrame(u16* palette_buffer) {
+    // The texture already holds the last frame, so only convert the pixels when there's a new one
+    void DrawFrame(const u16* palette_buffer, bool new_frame) {
         if (!renderer) return;
-        void* pixelsraw;
-        int pitch;
-        SDL_LockTexture(texture, nullptr, &pixelsraw, &pitch );
-        u32* pixels = reinterpret_cast<u32*>(pixelsraw);
-        for (int i = 0; i < 256 * 240; i++) {
-            pixels[i] = FullPalette[palette_buffer[i]];
+        if (new_frame) {
+            void* pixelsraw;
+            int pitch;
+            SDL_LockTexture(texture, nullptr, &pixelsraw, &pitch );
+            u32* pixels = reinterpret_cast<u32*>(pixelsraw);
+            for (int i = 0; i < 256 * 240; i++) {
+                pixels[i] = FullPalette[palette_buffer[i]];
+            }
+            SDL_UnlockTexture(texture);
         }
-        SDL_UnlockTexture(texture);
         SDL_RenderClear(renderer); //clears the renderer
         SDL_SetRenderTarget(renderer, nullptr);
         SDL_RenderTexture(renderer, texture, nullptr, nullptr);
@@ -98,6 +101,24 @@ static std::unique_ptr<EmuThread> emu;
     argparse::ArgumentParser program("brutenes");
     program.add_argument("romfile");
     program.add_argument("-s", "--save-state");
+    program.add_argument("--trace")
+        .help("write a binary trace of every instruction to this file, read it with brutenes-tracedump");
+    program.add_argument("--profile")
+        .help("profile the guest code by PC and opcode and print a report on exit")
+        .default_value(false)
+        .implicit_value(true);
+    program.add_argument("--recompiler")
+        .help("run the CPU with the x86-64 recompiler instead of the interpreter")
+        .default_value(false)
+        .implicit_value(true);
+    program.add_argument("--packed-chr")
+        .help("keep decoded CHR at 2 bits per pixel instead of a byte per pixel")
+        .default_value(false)
+        .implicit_value(true);
+    program.add_argument("--render-threads")
+        .help("draw frames on this many worker threads, a frame behind the emulation")
+        .default_value(0)
+        .scan<'i', int>();
     
     try {
         program.parse_args(argc, argv);
@@ -120,14 +141,34 @@ static std::unique_ptr<EmuThread> emu;
         return 1;
     }
 
+    if (program.get<bool>("--recompiler")) {
+        emu->nes->SetCPUBackend(CPU::Backend::Recompiler);
+    }
+    if (program.get<bool>("--packed-chr")) {
+        emu->nes->SetPixelCache(FakeVirtualMemory::PixelCache::Packed);
+    }
+    if (auto workers = program.get<int>("--render-threads"); workers > 0) {
+        emu->nes->SetRenderThreads(workers);
+    }
+    if (auto trace = program.present("--trace")) {
+        emu->nes->StartTrace(*trace);
+    }
+    if (program.get<bool>("--profile")) {
+        emu->nes->StartProfiler();
+    }
+
     emu->Start();
 
     return 0;
 }
 
 static int frame_count = 0;
+// Sequence number of the frame in the texture, the blank one to start with
+static u64 presented_frame = ~0ull;
 int SDL_AppIterate(void) {
-    frontend->DrawFrame(emu->GetFrame());
+    const auto frame = emu->GetFrame();
+    frontend->DrawFrame(frame.pixels, frame.sequence != presented_frame);
+    presented_frame = frame.sequence;
 //    frame_count = (frame_count+1) % 60;
 //    if (frame_count == 0) {
 //        SPDLOG_WARN("FPS {}",
@@ -177,6 +218,7 @@ int SDL_AppEvent(const SDL_Event *event) {
 
 void SDL_AppQuit(void) {
     emu->Stop();
+    emu->nes->PrintProfile(stderr);
     // Cleanup SDL resources
     frontend.reset();
 }
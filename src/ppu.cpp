@@ -1,8 +1,33 @@
 
+#include <algorithm>
+#include <cstring>
+
 #include "bus.h"
 #include "scheduler.h"
 #include "ppu.h"
 
+#ifdef BRUTENES_PPU_SSE41
+#include <immintrin.h>
+#endif
+
+// Each bit of a bitplane byte moved to the bottom of its own byte, bit 7 first
+consteval std::array<u64, 256> GenPlaneRowLUT() {
+    std::array<u64, 256> out{};
+    for (u32 i = 0; i < 256; i++) {
+        for (u32 k = 0; k < 8; k++) {
+            out[i] |= (u64)((i >> (7 - k)) & 1) << (k * 8);
+        }
+    }
+    return out;
+}
+
+constexpr std::array<u64, 256> PLANE_ROW = GenPlaneRowLUT();
+
+// Same layout as Bus::PixelRowLookup, decoded straight from the two bitplanes
+static inline u64 DecodeTileRow(u8 plane0, u8 plane1) {
+    return PLANE_ROW[plane0] | PLANE_ROW[plane1] << 1;
+}
+
 u8 PPU::ReadRegister(u16 addr) {
     switch (addr & 0b0000'0111) {
     case 2:
@@ -46,6 +71,7 @@ void PPU::WriteRegister(u16 addr, u8 value) {
                 value &= 0xE3;
             }
             OAM[oam_addr++] = value;
+            oam_buckets_dirty = true;
         }
         break;
     case 5:
@@ -115,41 +141,73 @@ void PPU::WriteRegister(u16 addr, u8 value) {
     latch = value;
 }
 
-void PPU::OAMDMA() {
-
+void PPU::OAMDMA(const std::array<u8, 256>& page) {
+    if (scanline < SCANLINE_VBLANK_START && RenderingEnabled()) {
+        // Same as $2004 during rendering, each write only bumps OAMADDR by 4, and 256 of those wrap around to where it started
+        return;
+    }
+    // OAMADDR wraps, so the page lands in two pieces when it doesn't start at zero
+    const u8 start = oam_addr;
+    std::memcpy(&OAM[start], page.data(), 256 - start);
+    std::memcpy(OAM.data(), &page[256 - start], start);
+    // The unimplemented bits of every attribute byte read back as 0
+    for (int i = 2; i < 256; i += 4) {
+        OAM[i] &= 0xE3;
+    }
+    oam_buckets_dirty = true;
+    latch = page[255];
 }
 
 void PPU::CatchUp() {
-    // Before running apply any cached updates
-    u16 temp = scanline;
-    scanline = SCANLINE_VBLANK_START;
-    while (!bus.ppu_register_cache.empty()) {
-        auto& item = bus.ppu_register_cache.front();
-        if (item.is_write) {
+    // Run up to each logged register access and apply it on the dot it happened on
+    while (!bus.PPURegisterLogEmpty()) {
+        const auto& item = bus.ppu_register_log[bus.ppu_register_log_head % Bus::REGISTER_LOG_SIZE];
+        RunUntil(item.cycle);
+        if (item.addr == 0x4014) {
+            OAMDMA(bus.oam_dma_page);
+        } else if (item.is_write && (item.addr & 0b111) == 7
+                && scanline >= SCANLINE_VBLANK_START && scanline < SCANLINE_PRERENDER) {
+            // Uploads are long strings of $2007 writes, so take them all at once
+            bus.ppu_register_log_head += ApplyVRAMUpload();
+            continue;
+        } else if (item.is_write) {
             WriteRegister(item.addr, item.value);
         } else {
-            // This is a write cache, so right now we don't add reads.
-            // Later if we start scanning for reading $2002 for clearing
-            // the write toggle (IE: the value read from ppustatus is unused)
-            // then we could cache that read.
-            // ReadRegister(item.addr);
+            // Only predicted $2002 reads are logged, and all they have left to do is reset the write toggle
+            ReadRegister(item.addr);
         }
-        bus.ppu_register_cache.pop();
+        bus.ppu_register_log_head++;
     }
-    scanline = temp;
-    u16 old_scanline = scanline;
-    u16 old_cycle = cycle;
+    bus.ppu_register_log_written = 0;
+    RunUntil(timing.cycle_count);
+    ScheduleEvents();
+}
 
-    s64 cycles_to_run = timing.cycle_count - current_cycle;
-    auto orig_cycles = cycles_to_run;
+void PPU::RunUntil(u64 target) {
+    s64 cycles_to_run = (s64)(target - current_cycle);
     while (cycles_to_run > 0) {
-        // We can't use the fast scanline impl if we aren't on cycle 0
-        if (cycles_to_run > CYCLES_PER_SCANLINE && cycle == 0) {
+        // Once the vblank flag is set nothing happens until the pre-render line, so go straight
+        // to whichever of that or the target comes first
+        if ((scanline == SCANLINE_VBLANK_START && cycle > 1)
+                || (scanline > SCANLINE_VBLANK_START && scanline < SCANLINE_PRERENDER)) {
+            const s64 dots = std::min<s64>((cycles_to_run + Scheduler::NTSC_PPU_CLOCK_DIVIDER - 1) / Scheduler::NTSC_PPU_CLOCK_DIVIDER,
+                                           (SCANLINE_PRERENDER - scanline) * 341 - cycle);
+            current_cycle += dots * Scheduler::NTSC_PPU_CLOCK_DIVIDER;
+            scanline += (cycle + dots) / 341;
+            cycle = (cycle + dots) % 341;
+            cycles_to_run = (s64)(target - current_cycle);
+            continue;
+        }
+        u16 end_cycle = (scanline == SCANLINE_PRERENDER && !even_frame) ? 340 : 341;
+        // We can't use the fast scanline impl if we aren't on cycle 0, so run the part of the
+        // line up to wherever the catch up stops in one go. The short pre-render line goes
+        // through the span path too so the timing of scheduled events matches.
+        if (cycles_to_run > CYCLES_PER_SCANLINE && cycle == 0 && end_cycle == 341) {
             RunFastScanline();
         } else {
-            Tick();
+            const s64 dots = (cycles_to_run + Scheduler::NTSC_PPU_CLOCK_DIVIDER - 1) / Scheduler::NTSC_PPU_CLOCK_DIVIDER;
+            RunScanlineSpan(std::min<s64>(end_cycle, cycle + dots));
         }
-        u16 end_cycle = (scanline == SCANLINE_PRERENDER && !even_frame) ? 340 : 341;
         if (cycle == end_cycle) {
             cycle = 0;
             scanline++;
@@ -158,53 +216,159 @@ void PPU::CatchUp() {
             scanline = 0;
             even_frame = !even_frame;
         }
-        cycles_to_run = timing.cycle_count - current_cycle;
+        cycles_to_run = (s64)(target - current_cycle);
+    }
+}
+
+u64 PPU::NextVBlankEdge() const {
+    return std::min(NextDotCycle(SCANLINE_VBLANK_START, 1), NextDotCycle(SCANLINE_PRERENDER, 1));
+}
+
+u64 PPU::NextDotCycle(u16 line, u16 dot) const {
+    int lines = (line + (SCANLINE_PRERENDER + 1) - scanline) % (SCANLINE_PRERENDER + 1);
+    if (lines == 0 && dot < cycle) {
+        lines = SCANLINE_PRERENDER + 1;
+    }
+    s64 dots = (s64)lines * 341 + dot - cycle;
+    // Passing the end of the short pre-render line of an odd frame skips a dot
+    if (scanline + lines > SCANLINE_PRERENDER && !even_frame) {
+        dots--;
+    }
+    return current_cycle + dots * Scheduler::NTSC_PPU_CLOCK_DIVIDER;
+}
+
+u64 PPU::NextSpriteZeroCycle() const {
+    if (!mask.bg_enable || !mask.sp_enable) {
+        return ~0ull;
+    }
+    // Sprite 0 is drawn starting the line after its Y, so nothing can hit before its first pixel there
+    const u16 top = OAM[0] + 1;
+    const u16 bottom = std::min<u16>(top + (ctrl.sp_size ? 16 : 8), SCANLINE_VBLANK_START);
+    if (scanline >= top && scanline < bottom) {
+        return current_cycle;
+    }
+    if (top >= SCANLINE_VBLANK_START) {
+        return ~0ull;
+    }
+    return NextDotCycle(top, OAM[3] + 1);
+}
+
+void PPU::ScheduleEvents() {
+    // vblank starting raises the NMI, RunFrame checks if it's enabled
+    const u64 vblank_set = NextDotCycle(SCANLINE_VBLANK_START, 1);
+    if (vblank_set != scheduled_vblank_set) {
+        timing.ScheduleAt(vblank_set, InterruptSource::NMI);
+        scheduled_vblank_set = vblank_set;
+    }
+    const u64 vblank_clear = NextDotCycle(SCANLINE_PRERENDER, 1);
+    if (vblank_clear != scheduled_vblank_clear) {
+        timing.ScheduleAt(vblank_clear, InterruptSource::PPUStatus);
+        scheduled_vblank_clear = vblank_clear;
+    }
+    // Once the PPU is on sprite 0's lines any dot could hit, so there's no single one to stop on.
+    // A prediction that OAM or the mask changed out from under just ends a block early.
+    const u64 sprite_zero = NextSpriteZeroCycle();
+    if (status.sp_zero == 0 && sprite_zero != ~0ull && sprite_zero > timing.cycle_count
+            && sprite_zero != scheduled_sprite_zero) {
+        timing.ScheduleAt(sprite_zero, InterruptSource::PPUStatus);
+        scheduled_sprite_zero = sprite_zero;
     }
-//    SPDLOG_WARN("Catching up PPU cycles: {} old scanline: {} old cycle: {} new scanline: {} new cycle: {}", orig_cycles / 4, old_scanline, old_cycle, scanline, cycle);
 }
 
-void PPU::Tick() {
-    if (scanline == SCANLINE_VBLANK_START && cycle == 1) {
+bool PPU::PredictStatus(u64 at, u8& out) const {
+    // A dot has run by the time of the read if it starts before it
+    const u64 vblank_set = NextDotCycle(SCANLINE_VBLANK_START, 1);
+    const u64 vblank_clear = NextDotCycle(SCANLINE_PRERENDER, 1);
+    if (at > vblank_set && at > vblank_clear) {
+        return false;
+    }
+    // Sprite 0 can only be set while the flag is clear, which it will be once the pre-render line starts
+    if ((status.sp_zero == 0 || at > vblank_clear) && at > NextSpriteZeroCycle()) {
+        return false;
+    }
+
+    // Overflow gets set on dot 257 of any visible line whose bucket overflowed, but only the evaluations
+    // after the pre-render line clears it are still showing. Stale buckets would have to be rebuilt first.
+    bool overflow = false;
+    if (RenderingEnabled()) {
+        const bool stale = oam_buckets_dirty || oam_bucket_sprite_size != (ctrl.sp_size ? 16 : 8);
+        for (u16 line = 0; line < SCANLINE_VBLANK_START; line++) {
+            if (!stale && !line_sprite_overflow[line]) {
+                continue;
+            }
+            const u64 evaluated = NextDotCycle(line, 257);
+            if (at > evaluated) {
+                if (stale) {
+                    return false;
+                }
+                overflow |= at <= vblank_clear || evaluated > vblank_clear;
+            }
+        }
+    }
+
+    PPUSTATUS predicted = status;
+    if (at > vblank_set) {
+        predicted.vblank = 1;
+    } else if (at > vblank_clear) {
+        predicted.vblank = 0;
+        predicted.sp_zero = 0;
+        predicted.sp_overflow = 0;
+    }
+    if (overflow) {
+        predicted.sp_overflow = 1;
+    }
+    predicted.openbus = latch;
+    out = predicted.raw;
+    return true;
+}
+
+void PPU::RunScanlineSpan(u16 end_cycle) {
+    const u16 start_cycle = cycle;
+    const auto runs_dot = [&](u16 dot) { return start_cycle <= dot && dot < end_cycle; };
+
+    if (scanline == SCANLINE_VBLANK_START && runs_dot(1)) {
         status.vblank = 1;
     }
-    if (scanline == SCANLINE_FRAME_START && cycle == 1) {
+    if (scanline == SCANLINE_PRERENDER && runs_dot(1)) {
         status.vblank = 0;
         status.sp_zero = 0;
+        status.sp_overflow = 0;
     }
-    // HACK set sprite zero to mario 1 estimate
-    if (scanline == 31 && cycle == 100) {
-        status.sp_zero = 1;
+
+    // Dots 1-256 of the visible lines put out a pixel each
+    if (scanline < SCANLINE_VBLANK_START) {
+        const u16 first = std::max<u16>(start_cycle, 1) - 1;
+        const u16 last = std::min<u16>(end_cycle, 257) - 1;
+        if (first < last) {
+            RenderScanlineSpan(first, last);
+        }
     }
+
     // At dot 256 of each scanline
     //
     // If rendering is enabled, the PPU increments the vertical position in v.
     // The effective Y scroll coordinate is incremented, which is a complex
     // operation that will correctly skip the attribute table memory regions,
     // and wrap to the next nametable appropriately.
-    if (RenderingEnabled()) {
-        if (cycle == 256) {
+    if (RenderingEnabled() && (scanline < SCANLINE_VBLANK_START || scanline == SCANLINE_PRERENDER)) {
+        if (runs_dot(256)) {
             IncrementVScroll();
         }
-        if (cycle == 257) {
+        if (runs_dot(257)) {
             CopyHScrollToV();
+            // OAM evaluation happens for the scanline *after*, and the sprite fetches for it
+            // start here
+            if (scanline < SCANLINE_VBLANK_START) {
+                FastOAMEvaluation();
+            }
         }
-        if (scanline == SCANLINE_PRERENDER && cycle == 280) {
+        if (scanline == SCANLINE_PRERENDER && runs_dot(280)) {
             v = t;
         }
     }
 
-    // Cycle 0
-    // Idle
-
-    // Cycle 1 - 256
-
-    // Cycle 257-320
-
-    // Cycle 321-336
-
-    // Cycle 337-340
-    current_cycle += 4;
-    cycle += 1;
+    current_cycle += (end_cycle - start_cycle) * Scheduler::NTSC_PPU_CLOCK_DIVIDER;
+    cycle = end_cycle;
 }
 
 // High level scanline render implementation for speed
@@ -212,18 +376,23 @@ void PPU::RunFastScanline() {
     if (scanline == SCANLINE_VBLANK_START) {
         status.vblank = 1;
     }
-    if (scanline == SCANLINE_FRAME_START) {
+    if (scanline == SCANLINE_PRERENDER) {
         status.vblank = 0;
         status.sp_zero = 0;
+        status.sp_overflow = 0;
     }
 
+    if (scanline < SCANLINE_VBLANK_START) {
+        RenderScanlineSpan(0, 256);
+    }
     if (RenderingEnabled()) {
         if (scanline == SCANLINE_PRERENDER) {
             v = t;
         }
 
         if (scanline < SCANLINE_VBLANK_START) {
-            FastScanlineRender();
+            IncrementVScroll();
+            CopyHScrollToV();
             // OAM evaluation happens for the scanline *after* so read the next scanline's data in now
             FastOAMEvaluation();
         }
@@ -233,7 +402,7 @@ void PPU::RunFastScanline() {
     scanline++;
 }
 
-void PPU::FastOAMEvaluation() {
+void PPU::BuildOAMBuckets() {
     /*
 During all visible scanlines, the PPU scans through OAM to determine which sprites to render on the next scanline. Sprites found to be within range are copied into the secondary OAM, which is then used to initialize eight internal sprite output units.
 
@@ -263,107 +432,170 @@ During each pixel clock (341 total per scanline), the PPU accesses OAM in the fo
     Cycles 321-340+0: Background render pipeline initialization
         Read the first byte in secondary OAM (while the PPU fetches the first two background tiles for the next scanline)
      */
-    constexpr auto SpriteInRange = [](auto line, auto y, auto sprite_size) {
-        return line >= y && line < y + sprite_size;
-    };
-    spriteZeroFound = false;
     const u8 sprite_size = ctrl.sp_size ? 16 : 8;
-    std::memset(scanline_sp_attribute.data(), 0x00, scanline_sp_attribute.size() * sizeof (u8));
-    std::memset(scanline_sp_palette_buffer.data(), 0x00, scanline_sp_palette_buffer.size() * sizeof (u8));
-    // Cycles 1-64: Secondary OAM (32-byte buffer for current sprites on scanline) is initialized to $FF
-    // - attempting to read $2004 will return $FF. Internally, the clear operation is implemented by reading
-    // from the OAM and writing into the secondary OAM as usual, only a signal is active that makes the read always return $FF.
-    std::memset(secondaryOAM.data(), 0xff, secondaryOAM.size() * sizeof (u8));
-
-    u8 written = 0;
-    u16 n = 0;
-    while (n < 256) {
-        // 1. Starting at n = 0, read a sprite's Y-coordinate (OAM[n][0], copying it to the next open slot in secondary
-        // OAM (unless 8 sprites have been found, in which case the write is ignored).
-        //   1a. If Y-coordinate is in range, copy remaining bytes of sprite data (OAM[n][1] thru OAM[n][3]) into secondary OAM.
-        secondaryOAM[written * 4] = OAM[n];
-        if (SpriteInRange(scanline, OAM[n], sprite_size)) {
-            if (n == 0) {
-                spriteZeroFound = true;
+    oam_bucket_sprite_size = sprite_size;
+    oam_buckets_dirty = false;
+    line_sprite_count.fill(0);
+    line_sprite_overflow.fill(false);
+
+    // Rather than scanning OAM on every line, drop each sprite into the bucket of every line it
+    // covers. Buckets fill in OAM order, which is the order the scan would have found them in.
+    // Secondary OAM is never read back, so only which sprites were found is kept.
+    for (u16 n = 0; n < 256; n += 4) {
+        const u16 y = OAM[n];
+        for (u16 line = y; line < y + sprite_size && line < SCANLINE_VBLANK_START; line++) {
+            // 2c. If exactly 8 sprites have been found, disable writes to secondary OAM because it is full.
+            if (line_sprite_count[line] < 8) {
+                line_sprites[line][line_sprite_count[line]++] = n;
             }
-            secondaryOAM[written * 4 + 1] = OAM[n + 1];
-            secondaryOAM[written * 4 + 2] = OAM[n + 2];
-            secondaryOAM[written * 4 + 3] = OAM[n + 3];
-            written++;
         }
-        // 2. Increment n
-        //   2a. If n has overflowed back to zero (all 64 sprites evaluated), go to 4
-        //   2b. If less than 8 sprites have been found, go to 1
-        //   2c. If exactly 8 sprites have been found, disable writes to secondary OAM because it is full. This causes sprites in back to drop out.
-        n += 4;
-        if (written == 8) {
-            break;
+    }
+
+    // The overflow scan only runs on lines that filled up before the end of OAM, and it starts
+    // right after the eighth sprite, so replay it for just those lines
+    for (u16 line = 0; line < SCANLINE_VBLANK_START; line++) {
+        if (line_sprite_count[line] == 8) {
+            line_sprite_overflow[line] = EvaluateSpriteOverflow(line, line_sprites[line][7] + 4, sprite_size);
         }
     }
+}
 
-    // Start checking for sprite overflow
+bool PPU::EvaluateSpriteOverflow(u16 line, u16 n, u8 sprite_size) const {
+    constexpr auto SpriteInRange = [](auto line, auto y, auto sprite_size) {
+        return line >= y && line < y + sprite_size;
+    };
     // 3. Starting at m = 0, evaluate OAM[n][m] as a Y-coordinate.
-    if (n < 256) {
-        int m = 0;
-        while (n < 256) {
-            if (SpriteInRange(scanline, OAM[n + m], sprite_size)) {
-                //  3a. If the value is in range, set the sprite overflow flag in $2002 and read the next 3 entries of OAM
-                //    (incrementing 'm' after each byte and incrementing 'n' when 'm' overflows); if m = 3, increment n
-                status.sp_overflow = 1;
-                n += 4;
-            } else {
-                //  3b. If the value is not in range, increment n and m (without carry). If n overflows to 0, go to 4;
-                //    otherwise go to 3
-                //    The m increment is a hardware bug - if only n was incremented, the overflow flag would be set whenever
-                //    more than 8 sprites were present on the same scanline, as expected.
-                n += 4;
-                m = (m + 1) % 4;
-            }
+    int m = 0;
+    while (n < 256) {
+        if (SpriteInRange(line, OAM[n + m], sprite_size)) {
+            //  3a. If the value is in range, set the sprite overflow flag in $2002 and read the next 3 entries of OAM
+            //    (incrementing 'm' after each byte and incrementing 'n' when 'm' overflows); if m = 3, increment n
+            return true;
         }
+        //  3b. If the value is not in range, increment n and m (without carry). If n overflows to 0, go to 4;
+        //    otherwise go to 3
+        //    The m increment is a hardware bug - if only n was incremented, the overflow flag would be set whenever
+        //    more than 8 sprites were present on the same scanline, as expected.
+        n += 4;
+        m = (m + 1) % 4;
     }
     // 4. Attempt (and fail) to copy OAM[n][0] into the next free slot in secondary OAM, and increment n (repeat until HBLANK is reached)
     // soooo... do nothing?
+    return false;
+}
+
+void PPU::FastOAMEvaluation() {
+    const u8 sprite_size = ctrl.sp_size ? 16 : 8;
+    if (oam_buckets_dirty || oam_bucket_sprite_size != sprite_size) {
+        BuildOAMBuckets();
+    }
+
+    const u8 written = line_sprite_count[scanline];
+    spriteZeroFound = written != 0 && line_sprites[scanline][0] == 0;
+    if (line_sprite_overflow[scanline]) {
+        status.sp_overflow = 1;
+    }
 
     // Cycles 257-320: Sprite fetches (8 sprites total, 8 cycles per sprite)
     //   1-4: Read the Y-coordinate, tile number, attributes, and X-coordinate of the selected sprite from secondary OAM
     //   5-8: Read the X-coordinate of the selected sprite from secondary OAM 4 times (while the PPU fetches the sprite tile data)
     //   For the first empty sprite slot, this will consist of sprite #63's Y-coordinate followed by 3 $FF bytes; for subsequent empty sprite slots, this will be four $FF bytes
-
-    // Copy the attribute flags into the attribute buffer and then also
+    evaluated_sprites.count = written;
+    evaluated_sprites_generation++;
     for (int i = 0; i < written; i++) {
         // Get the X coord of the sprite
-        u8 spr_y = secondaryOAM[i * 4 + 0];
-        u8 spr_tile = secondaryOAM[i * 4 + 1];
-        u8 spr_attr = secondaryOAM[i * 4 + 2];
-        u8 spr_x = secondaryOAM[i * 4 + 3];
+        const u8* sprite = &OAM[line_sprites[scanline][i]];
+        u8 spr_y = sprite[0];
+        u8 spr_tile = sprite[1];
+        u8 spr_attr = sprite[2];
+        u8 spr_x = sprite[3];
         u16 chr_tile_addr = (ctrl.sp_pattern << 12) | spr_tile * 16;
         u8 fine_y = scanline - spr_y;
         if ((spr_attr & (1 << 7)) != 0) {
             // Vertical flip is set so invert spr_y;
             fine_y = (spr_y + sprite_size) - scanline;
         }
-        u8 fine_x = ((spr_attr & (1 << 6)) != 0) ? 7 : 0;
-        u8 fine_x_increment = ((spr_attr & (1 << 6)) != 0) ? (u8)-1 : 1;
-        u8* pixel_cache = bus.PixelCacheLookup(chr_tile_addr, fine_y);
+        // Flipped sprites come back already mirrored, so every row is a straight 8 byte copy
+        const bool flip_h = (spr_attr & (1 << 6)) != 0;
+        evaluated_sprites.sprites[i] = EvaluatedSprites::Sprite{
+            .pixels = bus.PixelRowLookup(chr_tile_addr, fine_y, flip_h),
+            .x = spr_x,
+            // This always reads back zero, so we are allowed to overwrite this but only in internal buffers
+            .attr = (u8)(spr_attr | ((i == 0 && spriteZeroFound) ? SPRITE_ZERO_TAG : 0)),
+        };
+    }
+
+    // The render workers draw from the snapshot of evaluated_sprites, and only sprite 0 lines are drawn here
+    if (render_pool && !spriteZeroFound) {
+        return;
+    }
+    // Lines without sprites are common, so only clear the buffers when the last line drew into them
+    if (sprite_buffers_dirty) {
+        std::memset(scanline_sp_attribute.data(), 0x00, scanline_sp_attribute.size() * sizeof (u8));
+        std::memset(scanline_sp_palette_buffer.data(), 0x00, scanline_sp_palette_buffer.size() * sizeof (u8));
+    }
+    sprite_buffers_dirty = written != 0;
+    DrawEvaluatedSprites(evaluated_sprites, scanline_sp_palette_buffer.data(), scanline_sp_attribute.data());
+}
+
+void PPU::DrawEvaluatedSprites(const EvaluatedSprites& evaluated, u8* sp_pixel, u8* sp_attr) {
+    for (int i = 0; i < evaluated.count; i++) {
+        const auto& sprite = evaluated.sprites[i];
+        u8 row[8];
+        std::memcpy(row, &sprite.pixels, sizeof(row));
+        // Sprites hanging off the right edge are clipped at the last pixel
+        const int width = std::min(8, 256 - sprite.x);
         // for each pixel in this sprite, check if there is already a non transparent pixel and cover it
-        for (int j = spr_x; j < spr_x + 8; j++) {
-            if (j > 256) break;
-            if (scanline_sp_palette_buffer[j] == 0) {
-                scanline_sp_palette_buffer[j] = pixel_cache[fine_x];
-
-                scanline_sp_attribute[j] = spr_attr;
-                if (i == 0 && spriteZeroFound) {
-                    // This always reads back zero, so we are allowed to overwrite this but only in internal buffers
-                    scanline_sp_attribute[j] |= SPRITE_ZERO_TAG;
-                }
+        for (int j = 0; j < width; j++) {
+            if (sp_pixel[sprite.x + j] == 0) {
+                sp_pixel[sprite.x + j] = row[j];
+                sp_attr[sprite.x + j] = sprite.attr;
             }
-            // If horizontally flipped, then read it from right to left instead
-            fine_x += fine_x_increment;
         }
     }
 }
 
 
+u32 PPU::ApplyVRAMUpload() {
+    // Nothing looks at v in vblank, so the writes can all land at once as long as none of them
+    // is past the start of the pre-render line. Outside vblank v is either moved by rendering or
+    // picks the backdrop color, so those writes go one at a time.
+    const u64 end = NextDotCycle(SCANLINE_PRERENDER, 0);
+    std::array<u8, Bus::REGISTER_LOG_SIZE> values;
+    u32 count = 0;
+    for (u32 i = bus.ppu_register_log_head; i != bus.ppu_register_log_tail; i++) {
+        const auto& item = bus.ppu_register_log[i % Bus::REGISTER_LOG_SIZE];
+        if (!item.is_write || (item.addr & 0b111) != 7 || item.cycle > end) {
+            break;
+        }
+        values[count++] = item.value;
+    }
+
+    const u16 step = ctrl.vertical_write ? 32 : 1;
+    const u8* data = values.data();
+    u32 remaining = count;
+    while (remaining > 0) {
+        const u16 addr = v & 0x3FFF;
+        if (addr >= 0x3F00) {
+            // Palette writes have their own mirroring, so those go one at a time
+            WriteRegister(0x2007, *data++);
+            remaining--;
+            continue;
+        }
+        // Copy up to the end of the bank window, or the palette if that comes first. Neither
+        // the 14 bit address nor the palette can be crossed without reaching one of those.
+        const u16 limit = std::min<u16>((addr | (FakeVirtualMemory::BANK_WINDOW-1)) + 1, addr < 0x3C00 ? 0x4000 : 0x3F00);
+        const u32 n = std::min<u32>(remaining, (limit - addr + step - 1) / step);
+        bus.WriteVRAMRun(addr, data, n, step);
+        v = (v + n * step) & 0x7FFF;
+        latch = data[n - 1];
+        data += n;
+        remaining -= n;
+    }
+    bus.vram_addr = (v & 0x3FFF);
+    return count;
+}
+
 void PPU::IncrementV() {
     if(scanline >= SCANLINE_VBLANK_START || !RenderingEnabled()) {
         v = (v + (ctrl.vertical_write ? 32 : 1)) & 0x7FFF;
@@ -426,88 +658,296 @@ void PPU::CopyHScrollToV() {
 }
 
 
-void PPU::FastScanlineRender() {
-    // Shortcut: Copy the entire horizontal strip of tile ids from the nametable
-    // Load the nametable strip for this address, including across the mirror
-    std::array<u8, 0x40> nmt_strip{};
-    std::array<u8, 0x40> atr_strip{};
-    // Intentionally strip the bottom 5 bits since we want the start of the row
-    u16 course_y = (v & 0b11'11100000);
-    // Now that we have our line of tiles to read from, decode the pixels
-    // into the palette data
-    u8 fine_x = x;
+// Palette lookups for pixels [first, last) of a scanline. bg holds 4 bit background palette indices,
+// and the sprite buffers hold the sprite pixel and attributes filled in by FastOAMEvaluation. Returns
+// true if an opaque sprite zero pixel lands on a nonzero background color at or after sprite_zero_first.
+bool PPU::ComposeScanlineScalar(const u8* bg, const u8* sp_pixel, const u8* sp_attr, const u8* pal,
+                                u16* out, int first, int last, int sprite_zero_first) {
+    std::array<u8, 16> bg_colors{};
+    for (int i = 0; i < 16; i++) {
+        bg_colors[i] = (i & 0b11) ? pal[i] : pal[0];
+    }
+    bool sprite_zero_hit = false;
+    for (int i = first; i < last; i++) {
+        const u8 bg_color = bg_colors[bg[i]];
+        const u8 spr_palette = sp_pixel[i];
+        const u8 spr_attr = sp_attr[i];
+        if (spr_palette != 0 && (spr_attr & SPRITE_ZERO_TAG) != 0 && bg_color != 0
+                && i != 255 && i >= sprite_zero_first) {
+            sprite_zero_hit = true;
+        }
+        // Sprite priority
+        const bool bg_priority = (spr_attr & (1 << 5)) != 0;
+        if (spr_palette == 0 || bg_priority) {
+            out[i] = bg_color;
+        } else {
+            out[i] = pal[(spr_attr & 0b11) + 0x10 + spr_palette];
+        }
+    }
+    return sprite_zero_hit;
+}
+
+#ifdef BRUTENES_PPU_SSE41
+// Same as ComposeScanlineScalar, 16 pixels at a time. Both palettes fit in a single register
+// each, so the lookups are byte shuffles and sprite priority is a blend.
+__attribute__((target("sse4.1")))
+bool PPU::ComposeScanlineSSE41(const u8* bg, const u8* sp_pixel, const u8* sp_attr, const u8* pal,
+                               u16* out, int first, int last, int sprite_zero_first) {
+    const __m128i zero = _mm_setzero_si128();
+    // Every fourth background entry is transparent and shows the backdrop color instead
+    const __m128i bg_lut = _mm_blendv_epi8(_mm_loadu_si128((const __m128i*)pal), _mm_set1_epi8((char)pal[0]),
+                                           _mm_set1_epi32(0xff));
+    const __m128i sp_lut = _mm_loadu_si128((const __m128i*)(pal + 0x10));
+    const __m128i attr_palette = _mm_set1_epi8(0b11);
+    const __m128i attr_priority = _mm_set1_epi8(1 << 5);
+    const __m128i attr_sprite_zero = _mm_set1_epi8(SPRITE_ZERO_TAG);
+
+    bool sprite_zero_hit = false;
+    int i = first;
+    for (; i + 16 <= last; i += 16) {
+        const __m128i bg_color = _mm_shuffle_epi8(bg_lut, _mm_loadu_si128((const __m128i*)(bg + i)));
+        const __m128i spr_palette = _mm_loadu_si128((const __m128i*)(sp_pixel + i));
+        const __m128i spr_attr = _mm_loadu_si128((const __m128i*)(sp_attr + i));
+
+        const __m128i sp_color = _mm_shuffle_epi8(sp_lut, _mm_add_epi8(_mm_and_si128(spr_attr, attr_palette), spr_palette));
+        const __m128i transparent = _mm_cmpeq_epi8(spr_palette, zero);
+        const __m128i behind = _mm_cmpeq_epi8(_mm_and_si128(spr_attr, attr_priority), attr_priority);
+        const __m128i color = _mm_blendv_epi8(sp_color, bg_color, _mm_or_si128(transparent, behind));
+        _mm_storeu_si128((__m128i*)(out + i), _mm_cvtepu8_epi16(color));
+        _mm_storeu_si128((__m128i*)(out + i + 8), _mm_cvtepu8_epi16(_mm_srli_si128(color, 8)));
+
+        const __m128i sprite_zero = _mm_andnot_si128(_mm_or_si128(transparent, _mm_cmpeq_epi8(bg_color, zero)),
+                                                     _mm_cmpeq_epi8(_mm_and_si128(spr_attr, attr_sprite_zero), attr_sprite_zero));
+        u32 hits = _mm_movemask_epi8(sprite_zero);
+        if (hits == 0)
+            continue;
+        // Pixel 255 never hits
+        if (i == 240)
+            hits &= 0x7fff;
+        if (sprite_zero_first >= i + 16)
+            hits = 0;
+        else if (sprite_zero_first > i)
+            hits &= 0xffff << (sprite_zero_first - i);
+        sprite_zero_hit |= hits != 0;
+    }
+    // Whatever is left of a partial span is less than a register wide
+    if (i < last) {
+        sprite_zero_hit |= ComposeScanlineScalar(bg, sp_pixel, sp_attr, pal, out, i, last, sprite_zero_first);
+    }
+    return sprite_zero_hit;
+}
+#endif
+
+bool PPU::ComposeMaskedScanline(ComposeScanlineFn compose, PPUMASK mask, const u8* bg, const u8* sp_pixel,
+                                const u8* sp_attr, const u8* pal, u16* out, int first, int last,
+                                int sprite_zero_first) {
+    // Sprites are hidden on the whole line with sprites off, or the leftmost 8 pixels with
+    // sp_left clear. Those pixels are composed against empty sprite buffers.
+    static constexpr std::array<u8, 256> NO_SPRITES{};
+    const int hidden = std::clamp(mask.sp_enable ? (mask.sp_left ? 0 : 8) : 256, first, last);
+    bool sprite_zero_hit = false;
+    if (first < hidden) {
+        sprite_zero_hit |= compose(bg, NO_SPRITES.data(), NO_SPRITES.data(), pal, out, first, hidden, sprite_zero_first);
+    }
+    if (hidden < last) {
+        sprite_zero_hit |= compose(bg, sp_pixel, sp_attr, pal, out, hidden, last, sprite_zero_first);
+    }
+    return sprite_zero_hit;
+}
+
+PPU::ComposeScanlineFn PPU::SelectComposeScanline() {
+#ifdef BRUTENES_PPU_SSE41
+    if (__builtin_cpu_supports("sse4.1")) {
+        return &PPU::ComposeScanlineSSE41;
+    }
+#endif
+    return &PPU::ComposeScanlineScalar;
+}
+
+void PPU::RenderScanlineSpan(u16 first, u16 last) {
+    u16* out = &rendering_to[scanline * 256];
+    if (render_pool) {
+        // The frame buffer is the workers' until they've drawn the frame, and the only part of the
+        // pixels the CPU can see is sprite 0, so that's all that's drawn here
+        RecordScanlineSpan(first, last);
+        out = sprite_zero_line.data();
+    }
+    if (!RenderingEnabled()) {
+        // With rendering off the PPU shows the backdrop, or the palette entry v points at
+        const u8 color = (v & 0x3f00) == 0x3f00 ? palette[v & 0x1f] : palette[0];
+        std::fill(out + first, out + last, color);
+        return;
+    }
+
     // Combine the low bit of the nametable with the coarse x
-    u8 coarse_x = (v & (0x20-1)) | ((v & 0b100'00000000) >> 5);
+    const u8 start_coarse_x = (v & (0x20-1)) | ((v & 0b100'00000000) >> 5);
+    if (!render_pool || (spriteZeroFound && mask.bg_enable && mask.sp_enable)) {
+        DrawScanlineSpan(first, last, start_coarse_x, out);
+    }
+
+    // Coarse X moves on at the end of every group, so the next span picks up where this one stopped
+    const u8 next_coarse_x = (start_coarse_x + last / 8 - first / 8) % 0x40;
+    v = (v & ~0b100'00011111) | (next_coarse_x & 0x1f) | (next_coarse_x & 0x20) << 5;
+}
+
+void PPU::DrawScanlineSpan(u16 first, u16 last, u8 start_coarse_x, u16* out) {
+    // Read the tile ids straight out of the two nametables this row can scroll across, and the
+    // tile palettes out of the decoded attribute cache
+    u8 fine_x = x;
+    u8 coarse_x = start_coarse_x;
     u8 fine_y = v >> 12;
 
-    u16 tile_strip_addr = 0x2000 | course_y;
-    u16 tile_strip_attr = 0x3C0 | ((v >> 4) & 0x38);
-    u8 tile_attr_top_or_bottom = (v & 0x7);
-    u8* left_nmt = bus.DirectVRAMPageAccess(tile_strip_addr);
-    u16 right_nmt_addr = tile_strip_addr ^ (0x400);
-    u8* right_nmt = bus.DirectVRAMPageAccess(right_nmt_addr);
-    for (int i = 0; i < 0x20; i++) {
-        u16 offset = (tile_strip_addr & 0x3ff) | i;
-        nmt_strip[i] = left_nmt[offset];
-        nmt_strip[i + 0x20] = right_nmt[offset];
-        // Decode the attribute for this tile from the actual attribute byte
-        u8 attr_shift = tile_attr_top_or_bottom | ((i % 4) & 0b10);
-        atr_strip[i] = (left_nmt[tile_strip_attr | (i/2)] >> attr_shift) & 0b11;
-        atr_strip[i + 0x20] = (right_nmt[tile_strip_attr | (i/2)] >> attr_shift) & 0b11;
-    }
-    // Initialize the data for rendering this strip
-    // Lookup the tile in the pixel cache
-    u8 tile = nmt_strip[coarse_x];
-    u8 tile_attribute = atr_strip[coarse_x];
-    u8* tile_palette = &palette[tile_attribute * 4];
-    u16 chr_tile_addr = (ctrl.bg_pattern << 12) | tile * 16;
-    u8* pixel_cache = bus.PixelCacheLookup(chr_tile_addr, fine_y);
-
-    // For each tile in the background
-    for (int i = 0; i < 0x20; i++) {
-        // for each pixel in the tile
-        for (int j = 0; j < 8; j++) {
-            const auto p = pixel_cache[fine_x];
-            scanline_bg_pixel_buffer[i*8 + j] = p ? tile_palette[p] : palette[0];
-            fine_x++;
-            if (fine_x == 8) {
-                fine_x = 0;
-                coarse_x = (coarse_x + 1) % 0x40;
-                tile = nmt_strip[coarse_x];
-                tile_attribute = atr_strip[coarse_x];
-                tile_palette = &palette[tile_attribute * 4];
-                chr_tile_addr = (ctrl.bg_pattern << 12) | tile * 16;
-                pixel_cache = bus.PixelCacheLookup(chr_tile_addr, fine_y);
-            }
-        }
+    // Intentionally strip the coarse x bits since we want the start of the row
+    const u16 left_row_addr = 0x2000 | (v & 0b1011'11100000);
+    const u16 right_row_addr = left_row_addr | 0x400;
+    const std::array<const u8*, 2> nmt_row = {
+        bus.DirectVRAMPageAccess(left_row_addr) + (left_row_addr & 0x3e0),
+        bus.DirectVRAMPageAccess(right_row_addr) + (right_row_addr & 0x3e0),
+    };
+    const std::array<const u8*, 2> atr_row = {
+        bus.NametableRowPalettes(left_row_addr),
+        bus.NametableRowPalettes(right_row_addr),
+    };
+
+    // v points at the tile of the 8 pixel group first is in. Like the hardware shifters, fine X
+    // picks each pixel out of that group's tile and the one after it, so pixel i is at
+    // scanline_bg_index_buffer[i + fine_x] when every group's tile is stored at group * 8.
+    // Expand every tile row into palette indices, with the attribute in bits 2-3 of each pixel
+    const int last_group = (last - 1 + fine_x) / 8;
+    for (int i = first / 8; i <= last_group; i++) {
+        u8 tile = nmt_row[coarse_x >> 5][coarse_x & 0x1f];
+        u8 tile_attribute = atr_row[coarse_x >> 5][coarse_x & 0x1f];
+        u16 chr_tile_addr = (ctrl.bg_pattern << 12) | tile * 16;
+        u64 row = bus.PixelRowLookup(chr_tile_addr, fine_y);
+        row |= 0x0101010101010101ull * (tile_attribute << 2);
+        std::memcpy(&scanline_bg_index_buffer[i * 8], &row, sizeof(row));
+        coarse_x = (coarse_x + 1) % 0x40;
     }
 
-    for (int i = 0; i < 256; i++) {
-        // What really happens in the NES PPU is conceptually more like this:
-        //    For each pixel in the background buffer, the corresponding sprite pixel replaces it only if the
-        //    sprite pixel is opaque and front priority or if the background pixel is transparent.
-        u8 spr_attr = scanline_sp_attribute[i];
-        u8 spr_palette = scanline_sp_palette_buffer[i];
-        if (spr_palette != 0 && spr_attr != 0) {
-            const bool isSpriteZeroPixel = spr_attr & SPRITE_ZERO_TAG;
-            if (isSpriteZeroPixel) {
-                // use some number larger than the total number of cycles to indicate that sprites aren't enabled
-                const int _minimumDrawSpriteStandardCycle = mask.sp_enable ? (mask.sp_left ? 0 : 8) : 300;
-                if (scanline_bg_pixel_buffer[i] != 0 && i != 255 && mask.bg_enable && !status.sp_zero && i > _minimumDrawSpriteStandardCycle) {
-                    status.sp_zero = 1;
-                }
-            }
+    // What really happens in the NES PPU is conceptually more like this:
+    //    For each pixel in the background buffer, the corresponding sprite pixel replaces it only if the
+    //    sprite pixel is opaque and front priority or if the background pixel is transparent.
+    // use some number larger than the total number of cycles to indicate that sprites aren't enabled
+    const int _minimumDrawSpriteStandardCycle = mask.sp_enable ? (mask.sp_left ? 0 : 8) : 300;
+    const bool sprite_zero_hit = ComposeMaskedScanline(compose_scanline, mask, &scanline_bg_index_buffer[fine_x],
+                                                       scanline_sp_palette_buffer.data(), scanline_sp_attribute.data(),
+                                                       palette.data(), out, first, last,
+                                                       _minimumDrawSpriteStandardCycle + 1);
+    if (sprite_zero_hit && mask.bg_enable) {
+        status.sp_zero = 1;
+    }
+}
+
+void PPU::RecordScanlineSpan(u16 first, u16 last) {
+    auto& frame = snapshots[recording_snapshot];
+    // Outside of mid frame updates VRAM only changes in vblank, so this is usually one copy per
+    // frame. The sprites are the ones the last evaluation found, which is what the sprite
+    // buffers hold when this span is drawn without the workers.
+    if (frame.vram.empty() || bus.vram_write_generation != snapshot_vram_generation) {
+        bus.CopyVRAM(frame.vram.emplace_back());
+        snapshot_vram_generation = bus.vram_write_generation;
+    }
+    if (frame.sprites.empty() || evaluated_sprites_generation != snapshot_sprites_generation) {
+        frame.sprites.push_back(evaluated_sprites);
+        snapshot_sprites_generation = evaluated_sprites_generation;
+    }
+    frame.spans.push_back(SpanSnapshot{
+        scanline, first, last, v, x, ctrl, mask,
+        (u16)(frame.vram.size() - 1), (u16)(frame.sprites.size() - 1), palette,
+    });
+}
+
+void PPU::RenderSnapshotBand(const FrameSnapshot& frame, u16 first_line, u16 last_line, ComposeScanlineFn compose) {
+    alignas(16) std::array<u8, 8 * 33> bg_index{};
+    std::array<u8, 256> sp_pixel{};
+    std::array<u8, 256> sp_attr{};
+
+    for (const auto& span : frame.spans) {
+        if (span.line < first_line || span.line >= last_line)
+            continue;
+        u16* out = &frame.target[span.line * 256];
+        const auto& pal = span.palette;
+        if (!span.mask.bg_enable && !span.mask.sp_enable) {
+            const u8 color = (span.v & 0x3f00) == 0x3f00 ? pal[span.v & 0x1f] : pal[0];
+            std::fill(out + span.first, out + span.last, color);
+            continue;
         }
-        // Sprite priority
-        const bool bg_priority = (spr_attr & (1 << 5)) != 0;
-        if ((bg_priority && spr_palette != 0) || spr_palette == 0) {
-            rendering_to[(scanline * 256) + i] = scanline_bg_pixel_buffer[i];
-        } else {
-            u8* pal = &palette[(spr_attr&0b11) + 0x10];
-            rendering_to[(scanline * 256) + i] = pal[scanline_sp_palette_buffer[i]];
+        const auto& vram = frame.vram[span.vram];
+
+        // Background, the same walk as DrawScanlineSpan with the attributes read straight out
+        // of the attribute table
+        const u8 fine_x = span.x;
+        const u8 fine_y = span.v >> 12;
+        const u8 coarse_y = (span.v >> 5) & 0x1f;
+        const u8 shift_y = (coarse_y & 0b10) << 1;
+        u8 coarse_x = (span.v & (0x20-1)) | ((span.v & 0b100'00000000) >> 5);
+        const u16 left_row_addr = 0x2000 | (span.v & 0b1011'11100000);
+        const std::array<u16, 2> row_addr = {left_row_addr, (u16)(left_row_addr | 0x400)};
+        const int last_group = (span.last - 1 + fine_x) / 8;
+        for (int i = span.first / 8; i <= last_group; i++) {
+            const u16 nmt_row = row_addr[coarse_x >> 5];
+            const u8 column = coarse_x & 0x1f;
+            const u8 tile = vram[nmt_row + column];
+            const u8 attribute = vram[(nmt_row & 0x2c00) + FakeVirtualMemory::ATTRIBUTE_OFFSET + (coarse_y / 4) * 8 + column / 4];
+            const u8 tile_attribute = (attribute >> (shift_y | (column & 0b10))) & 0b11;
+            const u16 chr_addr = (span.ctrl.bg_pattern << 12) | tile * 16 | fine_y;
+            u64 row = DecodeTileRow(vram[chr_addr], vram[chr_addr + 8]);
+            row |= 0x0101010101010101ull * (tile_attribute << 2);
+            std::memcpy(&bg_index[i * 8], &row, sizeof(row));
+            coarse_x = (coarse_x + 1) % 0x40;
         }
+
+        // Sprites, laid out the same way FastOAMEvaluation fills the sprite buffers. The sprite 0
+        // flag was already worked out on the emulator thread, so the hit compose reports is ignored.
+        sp_pixel.fill(0);
+        sp_attr.fill(0);
+        DrawEvaluatedSprites(frame.sprites[span.sprites], sp_pixel.data(), sp_attr.data());
+
+        ComposeMaskedScanline(compose, span.mask, &bg_index[fine_x], sp_pixel.data(), sp_attr.data(), pal.data(),
+                              out, span.first, span.last, 256);
     }
+}
 
-    IncrementVScroll();
-    CopyHScrollToV();
-}
\ No newline at end of file
+void PPU::PublishFrame() {
+    buffer_sequence[render_index] = ++frame_sequence;
+    render_index = ready_buffer.exchange(render_index | NEW_FRAME, std::memory_order_acq_rel) & BUFFER_INDEX;
+    rendering_to = buffers[render_index];
+}
+
+void PPU::SwapBuffer() {
+    if (!render_pool) {
+        PublishFrame();
+        return;
+    }
+    // Emulation runs at most one frame ahead of the workers, so the frame they're on has to be
+    // finished before it can be published and the next one handed over
+    render_pool->Wait();
+    if (snapshot_in_flight) {
+        PublishFrame();
+    }
+    auto& frame = snapshots[recording_snapshot];
+    frame.target = rendering_to;
+    recording_snapshot ^= 1;
+    auto& next = snapshots[recording_snapshot];
+    next.spans.clear();
+    next.vram.clear();
+    next.sprites.clear();
+    snapshot_in_flight = true;
+    render_pool->Start([&frame, compose = compose_scanline](u32 band, u32 bands) {
+        RenderSnapshotBand(frame, band * SCANLINE_VBLANK_START / bands, (band + 1) * SCANLINE_VBLANK_START / bands, compose);
+    });
+}
+
+void PPU::SetRenderThreads(u32 workers) {
+    // Whatever the workers had in flight is dropped along with them
+    render_pool.reset();
+    snapshot_in_flight = false;
+    for (auto& frame : snapshots) {
+        frame.spans.clear();
+        frame.vram.clear();
+        frame.sprites.clear();
+    }
+    if (workers != 0) {
+        render_pool = std::make_unique<RenderPool>(workers);
+    }
+}
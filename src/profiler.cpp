@@ -0,0 +1,75 @@
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+#include "profiler.h"
+#include "trace.h"
+
+Profiler::Profiler() : counters(std::make_unique<Counters>()) {}
+
+void Profiler::Reset() {
+    *counters = Counters{};
+}
+
+u64 Profiler::Instructions() const {
+    return std::accumulate(counters->opcode.begin(), counters->opcode.end(), (u64)0,
+                           [](u64 sum, const Counter& c) { return sum + c.count; });
+}
+
+// Indices of the nonzero entries sorted by descending key
+template <typename T, typename Key>
+static std::vector<u32> TopEntries(const T& table, Key key, size_t top) {
+    std::vector<u32> indices{};
+    for (u32 i = 0; i < table.size(); i++) {
+        if (key(table[i]) != 0)
+            indices.push_back(i);
+    }
+    const auto count = std::min(top, indices.size());
+    std::partial_sort(indices.begin(), indices.begin() + count, indices.end(), [&](u32 a, u32 b) {
+        return key(table[a]) > key(table[b]);
+    });
+    indices.resize(count);
+    return indices;
+}
+
+void Profiler::Report(std::FILE* out, size_t top) const {
+    const auto cycles = [](const Counter& c) { return c.cycles; };
+    const auto value = [](u64 v) { return v; };
+    const u64 total_cycles = std::accumulate(counters->opcode.begin(), counters->opcode.end(), counters->idle_cycles,
+                                             [](u64 sum, const Counter& c) { return sum + c.cycles; });
+    const auto percent = [&](u64 part) { return total_cycles ? 100.0 * part / total_cycles : 0.0; };
+
+    fmt::print(out, "Profile: {} CPU cycles, {} skipped in idle loops ({:.1f}%)\n",
+               total_cycles, counters->idle_cycles, percent(counters->idle_cycles));
+    fmt::print(out, "{} instructions in {} handler dispatches\n", Instructions(), Dispatches());
+
+    fmt::print(out, "\nHottest PCs by cycles\n");
+    fmt::print(out, "{:>6} {:>14} {:>14} {:>7}\n", "PC", "count", "cycles", "%");
+    for (const auto pc : TopEntries(counters->pc, cycles, top)) {
+        const auto& c = counters->pc[pc];
+        fmt::print(out, "${:04X} {:>14} {:>14} {:>6.2f}%\n", pc, c.count, c.cycles, percent(c.cycles));
+    }
+
+    fmt::print(out, "\nHottest opcodes by cycles\n");
+    fmt::print(out, "{:>11} {:>14} {:>14} {:>7}\n", "opcode", "count", "cycles", "%");
+    for (const auto op : TopEntries(counters->opcode, cycles, top)) {
+        const auto& c = counters->opcode[op];
+        fmt::print(out, "{:02X} {} {:>14} {:>14} {:>6.2f}%\n", op, OpcodeName(op), c.count, c.cycles, percent(c.cycles));
+    }
+
+    fmt::print(out, "\nMMIO syncs by PC\n");
+    for (const auto pc : TopEntries(counters->mmio_syncs, value, top)) {
+        fmt::print(out, "${:04X} {:>14}\n", pc, counters->mmio_syncs[pc]);
+    }
+
+    fmt::print(out, "\nPredicted $2002 reads by PC\n");
+    for (const auto pc : TopEntries(counters->predicted_status_reads, value, top)) {
+        fmt::print(out, "${:04X} {:>14}\n", pc, counters->predicted_status_reads[pc]);
+    }
+
+    fmt::print(out, "\nBlock exits by PC\n");
+    for (const auto pc : TopEntries(counters->block_exits, value, top)) {
+        fmt::print(out, "${:04X} {:>14}\n", pc, counters->block_exits[pc]);
+    }
+}
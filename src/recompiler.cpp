@@ -0,0 +1,564 @@
+
+#include <cstddef>
+#include <cstring>
+
+#include "bus.h"
+#include "cpu.h"
+#include "recompiler.h"
+
+#ifdef BRUTENES_RECOMPILER_X64
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+enum Reg : u8 {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9 = 9, R10 = 10, R11 = 11,
+};
+
+// Host register assignment. Everything here is caller saved in the System V ABI
+// so native blocks don't need a prologue beyond loading the guest registers.
+constexpr Reg STATE = RDI;
+constexpr Reg RAM = RSI;
+constexpr Reg GUEST_A = R8;
+constexpr Reg GUEST_X = R9;
+constexpr Reg GUEST_Y = R10;
+constexpr Reg GUEST_P = R11;
+// Holds the last result that set N and Z. They are only folded back into P when needed.
+constexpr Reg GUEST_NZ = RDX;
+
+// x86 condition codes
+enum Cond : u8 {
+    CC_O = 0x0, CC_C = 0x2, CC_NC = 0x3, CC_Z = 0x4, CC_NZ = 0x5,
+};
+
+// x86 group 1 ALU operations (the /digit for 0x80 and 0x81)
+enum Alu : u8 {
+    ALU_ADD = 0, ALU_OR = 1, ALU_ADC = 2, ALU_SBB = 3, ALU_AND = 4, ALU_SUB = 5, ALU_XOR = 6, ALU_CMP = 7,
+};
+
+struct Mem {
+    Reg base;
+    int index; // -1 for none
+    s32 disp;
+};
+
+enum class Op {
+    LDA, LDX, LDY, STA, STX, STY,
+    ADC, SBC, AND, ORA, EOR, CMP, CPX, CPY, BIT,
+    INC, DEC, ASL, LSR, ROL, ROR,
+    TAX, TAY, TXA, TYA, INX, INY, DEX, DEY,
+    CLC, SEC, CLV, NOP,
+    BRANCH, JMP,
+};
+
+enum class Mode {
+    IMP, IMM, ZPA, ZPX, ZPY, ABS, REL,
+};
+
+// The subset of opcodes the recompiler knows how to translate
+bool Classify(u8 opcode, Op& op, Mode& mode) {
+    switch (opcode) {
+    case 0xa9: op = Op::LDA; mode = Mode::IMM; return true;
+    case 0xa5: op = Op::LDA; mode = Mode::ZPA; return true;
+    case 0xb5: op = Op::LDA; mode = Mode::ZPX; return true;
+    case 0xad: op = Op::LDA; mode = Mode::ABS; return true;
+    case 0xa2: op = Op::LDX; mode = Mode::IMM; return true;
+    case 0xa6: op = Op::LDX; mode = Mode::ZPA; return true;
+    case 0xb6: op = Op::LDX; mode = Mode::ZPY; return true;
+    case 0xae: op = Op::LDX; mode = Mode::ABS; return true;
+    case 0xa0: op = Op::LDY; mode = Mode::IMM; return true;
+    case 0xa4: op = Op::LDY; mode = Mode::ZPA; return true;
+    case 0xb4: op = Op::LDY; mode = Mode::ZPX; return true;
+    case 0xac: op = Op::LDY; mode = Mode::ABS; return true;
+    case 0x85: op = Op::STA; mode = Mode::ZPA; return true;
+    case 0x95: op = Op::STA; mode = Mode::ZPX; return true;
+    case 0x8d: op = Op::STA; mode = Mode::ABS; return true;
+    case 0x86: op = Op::STX; mode = Mode::ZPA; return true;
+    case 0x96: op = Op::STX; mode = Mode::ZPY; return true;
+    case 0x8e: op = Op::STX; mode = Mode::ABS; return true;
+    case 0x84: op = Op::STY; mode = Mode::ZPA; return true;
+    case 0x94: op = Op::STY; mode = Mode::ZPX; return true;
+    case 0x8c: op = Op::STY; mode = Mode::ABS; return true;
+    case 0x69: op = Op::ADC; mode = Mode::IMM; return true;
+    case 0x65: op = Op::ADC; mode = Mode::ZPA; return true;
+    case 0x75: op = Op::ADC; mode = Mode::ZPX; return true;
+    case 0x6d: op = Op::ADC; mode = Mode::ABS; return true;
+    case 0xe9:
+    case 0xeb: op = Op::SBC; mode = Mode::IMM; return true;
+    case 0xe5: op = Op::SBC; mode = Mode::ZPA; return true;
+    case 0xf5: op = Op::SBC; mode = Mode::ZPX; return true;
+    case 0xed: op = Op::SBC; mode = Mode::ABS; return true;
+    case 0x29: op = Op::AND; mode = Mode::IMM; return true;
+    case 0x25: op = Op::AND; mode = Mode::ZPA; return true;
+    case 0x35: op = Op::AND; mode = Mode::ZPX; return true;
+    case 0x2d: op = Op::AND; mode = Mode::ABS; return true;
+    case 0x09: op = Op::ORA; mode = Mode::IMM; return true;
+    case 0x05: op = Op::ORA; mode = Mode::ZPA; return true;
+    case 0x15: op = Op::ORA; mode = Mode::ZPX; return true;
+    case 0x0d: op = Op::ORA; mode = Mode::ABS; return true;
+    case 0x49: op = Op::EOR; mode = Mode::IMM; return true;
+    case 0x45: op = Op::EOR; mode = Mode::ZPA; return true;
+    case 0x55: op = Op::EOR; mode = Mode::ZPX; return true;
+    case 0x4d: op = Op::EOR; mode = Mode::ABS; return true;
+    case 0xc9: op = Op::CMP; mode = Mode::IMM; return true;
+    case 0xc5: op = Op::CMP; mode = Mode::ZPA; return true;
+    case 0xd5: op = Op::CMP; mode = Mode::ZPX; return true;
+    case 0xcd: op = Op::CMP; mode = Mode::ABS; return true;
+    case 0xe0: op = Op::CPX; mode = Mode::IMM; return true;
+    case 0xe4: op = Op::CPX; mode = Mode::ZPA; return true;
+    case 0xec: op = Op::CPX; mode = Mode::ABS; return true;
+    case 0xc0: op = Op::CPY; mode = Mode::IMM; return true;
+    case 0xc4: op = Op::CPY; mode = Mode::ZPA; return true;
+    case 0xcc: op = Op::CPY; mode = Mode::ABS; return true;
+    case 0x24: op = Op::BIT; mode = Mode::ZPA; return true;
+    case 0x2c: op = Op::BIT; mode = Mode::ABS; return true;
+    case 0xe6: op = Op::INC; mode = Mode::ZPA; return true;
+    case 0xf6: op = Op::INC; mode = Mode::ZPX; return true;
+    case 0xee: op = Op::INC; mode = Mode::ABS; return true;
+    case 0xc6: op = Op::DEC; mode = Mode::ZPA; return true;
+    case 0xd6: op = Op::DEC; mode = Mode::ZPX; return true;
+    case 0xce: op = Op::DEC; mode = Mode::ABS; return true;
+    case 0x0a: op = Op::ASL; mode = Mode::IMP; return true;
+    case 0x4a: op = Op::LSR; mode = Mode::IMP; return true;
+    case 0x2a: op = Op::ROL; mode = Mode::IMP; return true;
+    case 0x6a: op = Op::ROR; mode = Mode::IMP; return true;
+    case 0xaa: op = Op::TAX; mode = Mode::IMP; return true;
+    case 0xa8: op = Op::TAY; mode = Mode::IMP; return true;
+    case 0x8a: op = Op::TXA; mode = Mode::IMP; return true;
+    case 0x98: op = Op::TYA; mode = Mode::IMP; return true;
+    case 0xe8: op = Op::INX; mode = Mode::IMP; return true;
+    case 0xc8: op = Op::INY; mode = Mode::IMP; return true;
+    case 0xca: op = Op::DEX; mode = Mode::IMP; return true;
+    case 0x88: op = Op::DEY; mode = Mode::IMP; return true;
+    case 0x18: op = Op::CLC; mode = Mode::IMP; return true;
+    case 0x38: op = Op::SEC; mode = Mode::IMP; return true;
+    case 0xb8: op = Op::CLV; mode = Mode::IMP; return true;
+    case 0xea: op = Op::NOP; mode = Mode::IMP; return true;
+    case 0x10: case 0x30: case 0x50: case 0x70:
+    case 0x90: case 0xb0: case 0xd0: case 0xf0:
+        op = Op::BRANCH; mode = Mode::REL; return true;
+    case 0x4c: op = Op::JMP; mode = Mode::ABS; return true;
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
+class Recompiler::Emitter {
+public:
+    explicit Emitter(std::vector<u8>& out) : out(out) { out.clear(); }
+
+    [[nodiscard]] size_t Position() const { return out.size(); }
+
+    void PatchRel32(size_t at, size_t target) {
+        s32 rel = (s32)(target - (at + 4));
+        std::memcpy(&out[at], &rel, sizeof(rel));
+    }
+
+    void MovzxLoad(Reg dst, const Mem& m) { Rex(false, dst, m, false); Byte(0x0f); Byte(0xb6); ModRM(dst, m); }
+    void MovzxReg(Reg dst, Reg src) { Rex(false, dst, src, true); Byte(0x0f); Byte(0xb6); ModRM(dst, src); }
+    void Load64(Reg dst, const Mem& m) { Rex(true, dst, m, false); Byte(0x8b); ModRM(dst, m); }
+    void Store8(const Mem& m, Reg src) { Rex(false, src, m, true); Byte(0x88); ModRM(src, m); }
+    void Store16Imm(const Mem& m, u16 imm) { Byte(0x66); Rex(false, RAX, m, false); Byte(0xc7); ModRM(0, m); Word(imm); }
+    void Mov8(Reg dst, Reg src) { Rex(false, src, dst, true); Byte(0x88); ModRM(src, dst); }
+    void Mov8Imm(Reg dst, u8 imm) { Rex(false, RAX, dst, true); Byte(0xb0 + (dst & 7)); Byte(imm); }
+    void Mov32(Reg dst, Reg src) { Rex(false, src, dst, false); Byte(0x89); ModRM(src, dst); }
+    void Mov32Imm(Reg dst, u32 imm) { Rex(false, RAX, dst, false); Byte(0xb8 + (dst & 7)); Dword(imm); }
+    void Mov64Imm(Reg dst, u64 imm) { Rex(true, RAX, dst, false); Byte(0xb8 + (dst & 7)); Qword(imm); }
+    void Alu8Imm(Alu op, Reg dst, u8 imm) { Rex(false, RAX, dst, true); Byte(0x80); ModRM(op, dst); Byte(imm); }
+    void Alu8Mem(Alu op, Reg dst, const Mem& m) { Rex(false, dst, m, true); Byte((op << 3) | 0x02); ModRM(dst, m); }
+    void Alu32Imm(Alu op, Reg dst, u32 imm) { Rex(false, RAX, dst, false); Byte(0x81); ModRM(op, dst); Dword(imm); }
+    void Or32(Reg dst, Reg src) { Rex(false, src, dst, false); Byte(0x09); ModRM(src, dst); }
+    void Shl32Imm(Reg dst, u8 imm) { Rex(false, RAX, dst, false); Byte(0xc1); ModRM(4, dst); Byte(imm); }
+    // Group 2 shift by one: 2 = rcl, 3 = rcr, 4 = shl, 5 = shr
+    void Shift8(u8 op, Reg dst) { Rex(false, RAX, dst, true); Byte(0xd0); ModRM(op, dst); }
+    void Inc8(Reg dst) { Rex(false, RAX, dst, true); Byte(0xfe); ModRM(0, dst); }
+    void Dec8(Reg dst) { Rex(false, RAX, dst, true); Byte(0xfe); ModRM(1, dst); }
+    void Inc8Mem(const Mem& m) { Rex(false, RAX, m, true); Byte(0xfe); ModRM(0, m); }
+    void Dec8Mem(const Mem& m) { Rex(false, RAX, m, true); Byte(0xfe); ModRM(1, m); }
+    void Setcc(Cond cc, Reg dst) { Rex(false, RAX, dst, true); Byte(0x0f); Byte(0x90 | cc); ModRM(0, dst); }
+    void BtImm(Reg dst, u8 bit) { Rex(false, RAX, dst, false); Byte(0x0f); Byte(0xba); ModRM(4, dst); Byte(bit); }
+    void Test8Imm(Reg dst, u8 imm) { Rex(false, RAX, dst, true); Byte(0xf6); ModRM(0, dst); Byte(imm); }
+    void Test8(Reg a, Reg b) { Rex(false, b, a, true); Byte(0x84); ModRM(b, a); }
+    void Cmc() { Byte(0xf5); }
+    void Ret() { Byte(0xc3); }
+
+    // Emits a jcc with a placeholder target and returns the offset to patch
+    size_t Jcc(Cond cc) {
+        Byte(0x0f);
+        Byte(0x80 | cc);
+        size_t at = Position();
+        Dword(0);
+        return at;
+    }
+
+private:
+    void Byte(u8 b) { out.push_back(b); }
+    void Word(u16 w) { Byte(w & 0xff); Byte(w >> 8); }
+    void Dword(u32 d) { for (int i = 0; i < 4; i++) Byte(d >> (i * 8)); }
+    void Qword(u64 q) { for (int i = 0; i < 8; i++) Byte(q >> (i * 8)); }
+
+    // Byte sized operations always get a REX prefix so registers 4-7 mean spl-dil instead of ah-bh
+    void Rex(bool wide, int reg, int rm, bool byte_op) {
+        u8 rex = 0x40 | (wide << 3) | ((reg >> 3) & 1) << 2 | ((rm >> 3) & 1);
+        if (rex != 0x40 || byte_op)
+            Byte(rex);
+    }
+    void Rex(bool wide, int reg, const Mem& m, bool byte_op) {
+        int index = m.index < 0 ? 0 : m.index;
+        u8 rex = 0x40 | (wide << 3) | ((reg >> 3) & 1) << 2 | ((index >> 3) & 1) << 1 | ((m.base >> 3) & 1);
+        if (rex != 0x40 || byte_op)
+            Byte(rex);
+    }
+    void ModRM(int reg, int rm) { Byte(0xc0 | (reg & 7) << 3 | (rm & 7)); }
+    void ModRM(int reg, const Mem& m) {
+        // Always use the disp32 form, it keeps the encoding simple and rbp/r13 bases legal
+        if (m.index < 0) {
+            Byte(0x80 | (reg & 7) << 3 | (m.base & 7));
+        } else {
+            Byte(0x80 | (reg & 7) << 3 | 0x04);
+            Byte((m.index & 7) << 3 | (m.base & 7));
+        }
+        Dword(m.disp);
+    }
+
+    std::vector<u8>& out;
+};
+
+Recompiler::~Recompiler() {
+#ifdef BRUTENES_RECOMPILER_X64
+    if (code)
+        munmap(code, CODE_BUFFER_SIZE);
+#endif
+}
+
+bool Recompiler::Supported() {
+#ifdef BRUTENES_RECOMPILER_X64
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Recompiler::Init() {
+#ifdef BRUTENES_RECOMPILER_X64
+    if (code)
+        return true;
+    void* mapping = mmap(nullptr, CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        SPDLOG_WARN("Failed to allocate the recompiler code buffer Error: {}", strerror(errno));
+        return false;
+    }
+    code = static_cast<u8*>(mapping);
+    scratch.reserve(4096);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Recompiler::Flush() {
+    code_used = 0;
+    blocks_used = 0;
+    epoch++;
+}
+
+bool Recompiler::CanTranslate(const DecodedInstruction& inst) {
+    Op op;
+    Mode mode;
+    if (!Classify(inst.opcode, op, mode)) {
+        return false;
+    }
+    if (mode != Mode::ABS || op == Op::JMP) {
+        return true;
+    }
+    // Absolute addresses are resolved to a host pointer at compile time, which is only
+    // safe for plain memory. Anything that could hit a register stays in the interpreter.
+    const auto tag = bus.CPUPageTag(inst.operand);
+    if ((tag & FakeVirtualMemory::Tag::MMIO) != 0 || bus.DirectCPUPageAccess(inst.operand) == nullptr) {
+        return false;
+    }
+    switch (op) {
+    case Op::STA:
+    case Op::STX:
+    case Op::STY:
+        return true;
+    case Op::INC:
+    case Op::DEC:
+        // The interpreter still updates NZ when a RMW write is dropped, so keep those there
+        return (tag & FakeVirtualMemory::Tag::Write) != 0;
+    default:
+        return (tag & FakeVirtualMemory::Tag::Read) != 0;
+    }
+}
+
+const NativeBlock* Recompiler::Compile(const DecodedBlock& block) {
+#ifdef BRUTENES_RECOMPILER_X64
+    if (!code || block.count == 0 || !CanTranslate(block.code[0])) {
+        return nullptr;
+    }
+
+    Emitter e(scratch);
+    bool nz_pending = false;
+
+    const auto materialize_nz = [&] {
+        if (!nz_pending)
+            return;
+        e.MovzxReg(RCX, GUEST_NZ);
+        e.Alu32Imm(ALU_AND, RCX, CPU::Flags::N);
+        e.Test8(GUEST_NZ, GUEST_NZ);
+        e.Setcc(CC_Z, RAX);
+        e.MovzxReg(RAX, RAX);
+        e.Shl32Imm(RAX, 1);
+        e.Or32(RCX, RAX);
+        e.Alu32Imm(ALU_AND, GUEST_P, ~(u32)(CPU::Flags::N | CPU::Flags::Z));
+        e.Or32(GUEST_P, RCX);
+        nz_pending = false;
+    };
+    const auto set_nz = [&](Reg value) {
+        e.Mov32(GUEST_NZ, value);
+        nz_pending = true;
+    };
+    // Copies the 0/1 in a byte register into a single flag bit of P
+    const auto update_flag = [&](Reg value, u8 bit) {
+        e.MovzxReg(value, value);
+        if (bit)
+            e.Shl32Imm(value, bit);
+        e.Alu32Imm(ALU_AND, GUEST_P, ~(u32)(1 << bit));
+        e.Or32(GUEST_P, value);
+    };
+    const auto exit_to = [&](u16 pc, u32 cycles) {
+        materialize_nz();
+        e.Store8(Mem{STATE, -1, offsetof(GuestState, A)}, GUEST_A);
+        e.Store8(Mem{STATE, -1, offsetof(GuestState, X)}, GUEST_X);
+        e.Store8(Mem{STATE, -1, offsetof(GuestState, Y)}, GUEST_Y);
+        e.Store8(Mem{STATE, -1, offsetof(GuestState, P)}, GUEST_P);
+        e.Store16Imm(Mem{STATE, -1, offsetof(GuestState, PC)}, pc);
+        e.Mov32Imm(RAX, cycles);
+        e.Ret();
+    };
+    // Sets up the host address for a memory operand. ZPX/ZPY leave the address in rcx
+    // and absolute operands leave the host pointer in rax.
+    const auto address = [&](Mode mode, u16 operand) {
+        switch (mode) {
+        case Mode::ZPX:
+        case Mode::ZPY:
+            e.Mov32(RCX, mode == Mode::ZPX ? GUEST_X : GUEST_Y);
+            e.Alu8Imm(ALU_ADD, RCX, operand & 0xff);
+            e.MovzxReg(RCX, RCX);
+            return Mem{RAM, RCX, 0};
+        case Mode::ABS: {
+            const u8* page = bus.DirectCPUPageAccess(operand);
+            e.Mov64Imm(RAX, (u64)(uintptr_t)(page + (operand & (FakeVirtualMemory::BANK_WINDOW-1))));
+            return Mem{RAX, -1, 0};
+        }
+        case Mode::ZPA:
+        default:
+            return Mem{RAM, -1, (s32)(operand & 0xff)};
+        }
+    };
+    const auto load = [&](Reg dst, Mode mode, u16 operand) {
+        if (mode == Mode::IMM) {
+            e.Mov8Imm(dst, operand);
+        } else {
+            e.MovzxLoad(dst, address(mode, operand));
+        }
+    };
+    const auto alu = [&](Alu op, Reg dst, Mode mode, u16 operand) {
+        if (mode == Mode::IMM) {
+            e.Alu8Imm(op, dst, operand);
+        } else {
+            e.Alu8Mem(op, dst, address(mode, operand));
+        }
+    };
+    // Bank windows the block stores to, so their write generations can be bumped afterwards
+    u64 written_windows = 0;
+    const auto mark_written = [&](Mode mode, u16 operand) {
+        written_windows |= 1ull << (mode == Mode::ABS ? operand / FakeVirtualMemory::BANK_WINDOW : 0);
+    };
+    const auto store = [&](Reg src, Mode mode, u16 operand) {
+        // Writes to read only memory are dropped just like CheckedWrite8
+        if (mode == Mode::ABS && (bus.CPUPageTag(operand) & FakeVirtualMemory::Tag::Write) == 0)
+            return;
+        e.Store8(address(mode, operand), src);
+        mark_written(mode, operand);
+    };
+    const auto compare = [&](Reg reg, Mode mode, u16 operand) {
+        // The difference is computed straight into the NZ shadow since that's all it's needed for
+        e.Mov32(GUEST_NZ, reg);
+        if (mode == Mode::IMM) {
+            e.Alu8Imm(ALU_SUB, GUEST_NZ, operand);
+        } else {
+            e.Alu8Mem(ALU_SUB, GUEST_NZ, address(mode, operand));
+        }
+        e.Setcc(CC_NC, RCX);
+        update_flag(RCX, 0);
+        nz_pending = true;
+    };
+
+    // Load the guest registers
+    e.MovzxLoad(GUEST_A, Mem{STATE, -1, offsetof(GuestState, A)});
+    e.MovzxLoad(GUEST_X, Mem{STATE, -1, offsetof(GuestState, X)});
+    e.MovzxLoad(GUEST_Y, Mem{STATE, -1, offsetof(GuestState, Y)});
+    e.MovzxLoad(GUEST_P, Mem{STATE, -1, offsetof(GuestState, P)});
+    e.Load64(RAM, Mem{STATE, -1, offsetof(GuestState, ram)});
+
+    u16 pc = block.pc;
+    u32 cycles = 0;
+    u32 max_cycles = 0;
+    bool exited = false;
+    for (int i = 0; i < block.count && !exited; i++) {
+        const auto& inst = block.code[i];
+        if (!CanTranslate(inst)) {
+            break;
+        }
+        Op op;
+        Mode mode;
+        Classify(inst.opcode, op, mode);
+        const u16 operand = inst.operand;
+        const u16 next_pc = pc + inst.length;
+        cycles += inst.cycles;
+
+        switch (op) {
+        case Op::LDA: load(GUEST_A, mode, operand); set_nz(GUEST_A); break;
+        case Op::LDX: load(GUEST_X, mode, operand); set_nz(GUEST_X); break;
+        case Op::LDY: load(GUEST_Y, mode, operand); set_nz(GUEST_Y); break;
+        case Op::STA: store(GUEST_A, mode, operand); break;
+        case Op::STX: store(GUEST_X, mode, operand); break;
+        case Op::STY: store(GUEST_Y, mode, operand); break;
+        case Op::AND: alu(ALU_AND, GUEST_A, mode, operand); set_nz(GUEST_A); break;
+        case Op::ORA: alu(ALU_OR, GUEST_A, mode, operand); set_nz(GUEST_A); break;
+        case Op::EOR: alu(ALU_XOR, GUEST_A, mode, operand); set_nz(GUEST_A); break;
+        case Op::ADC:
+        case Op::SBC: {
+            // 6502 SBC is an add of the inverted operand, which is exactly x86 sbb with an inverted carry
+            Mem m{};
+            if (mode != Mode::IMM)
+                m = address(mode, operand);
+            e.BtImm(GUEST_P, 0);
+            if (op == Op::SBC)
+                e.Cmc();
+            const Alu alu_op = op == Op::ADC ? ALU_ADC : ALU_SBB;
+            if (mode == Mode::IMM) {
+                e.Alu8Imm(alu_op, GUEST_A, operand);
+            } else {
+                e.Alu8Mem(alu_op, GUEST_A, m);
+            }
+            e.Setcc(op == Op::ADC ? CC_C : CC_NC, RCX);
+            e.Setcc(CC_O, RAX);
+            update_flag(RCX, 0);
+            update_flag(RAX, 6);
+            set_nz(GUEST_A);
+            break;
+        }
+        case Op::CMP: compare(GUEST_A, mode, operand); break;
+        case Op::CPX: compare(GUEST_X, mode, operand); break;
+        case Op::CPY: compare(GUEST_Y, mode, operand); break;
+        case Op::BIT: {
+            e.MovzxLoad(RCX, address(mode, operand));
+            e.Mov32(RAX, RCX);
+            e.Alu32Imm(ALU_AND, RAX, CPU::Flags::N | CPU::Flags::V);
+            e.Alu32Imm(ALU_AND, GUEST_P, ~(u32)(CPU::Flags::N | CPU::Flags::V | CPU::Flags::Z));
+            e.Or32(GUEST_P, RAX);
+            e.Test8(GUEST_A, RCX);
+            e.Setcc(CC_Z, RAX);
+            update_flag(RAX, 1);
+            // N and Z are both in P now, so any pending result is stale
+            nz_pending = false;
+            break;
+        }
+        case Op::INC:
+        case Op::DEC: {
+            Mem m = address(mode, operand);
+            if (op == Op::INC) {
+                e.Inc8Mem(m);
+            } else {
+                e.Dec8Mem(m);
+            }
+            mark_written(mode, operand);
+            e.MovzxLoad(GUEST_NZ, m);
+            nz_pending = true;
+            break;
+        }
+        case Op::ASL:
+        case Op::LSR:
+        case Op::ROL:
+        case Op::ROR: {
+            if (op == Op::ROL || op == Op::ROR)
+                e.BtImm(GUEST_P, 0);
+            const u8 shift = op == Op::ASL ? 4 : op == Op::LSR ? 5 : op == Op::ROL ? 2 : 3;
+            e.Shift8(shift, GUEST_A);
+            e.Setcc(CC_C, RCX);
+            update_flag(RCX, 0);
+            set_nz(GUEST_A);
+            break;
+        }
+        case Op::TAX: e.Mov8(GUEST_X, GUEST_A); set_nz(GUEST_X); break;
+        case Op::TAY: e.Mov8(GUEST_Y, GUEST_A); set_nz(GUEST_Y); break;
+        case Op::TXA: e.Mov8(GUEST_A, GUEST_X); set_nz(GUEST_A); break;
+        case Op::TYA: e.Mov8(GUEST_A, GUEST_Y); set_nz(GUEST_A); break;
+        case Op::INX: e.Inc8(GUEST_X); set_nz(GUEST_X); break;
+        case Op::INY: e.Inc8(GUEST_Y); set_nz(GUEST_Y); break;
+        case Op::DEX: e.Dec8(GUEST_X); set_nz(GUEST_X); break;
+        case Op::DEY: e.Dec8(GUEST_Y); set_nz(GUEST_Y); break;
+        case Op::CLC: e.Alu32Imm(ALU_AND, GUEST_P, ~(u32)CPU::Flags::C); break;
+        case Op::SEC: e.Alu32Imm(ALU_OR, GUEST_P, CPU::Flags::C); break;
+        case Op::CLV: e.Alu32Imm(ALU_AND, GUEST_P, ~(u32)CPU::Flags::V); break;
+        case Op::NOP: break;
+        case Op::JMP:
+            max_cycles = cycles;
+            exit_to(operand, cycles);
+            exited = true;
+            break;
+        case Op::BRANCH: {
+            // Bits 6-7 of the opcode pick the flag and bit 5 is the value that takes the branch
+            static constexpr std::array<u8, 4> branch_flags = {
+                CPU::Flags::N, CPU::Flags::V, CPU::Flags::C, CPU::Flags::Z,
+            };
+            const u8 flag = branch_flags[inst.opcode >> 6];
+            const bool taken_if_set = (inst.opcode & 0x20) != 0;
+            const u16 target = next_pc + (s8)operand;
+            // Matches the penalty calculation in the interpreter's DECODE_REL
+            const u32 penalty = 1 + ((next_pc & 0xff00) == (target & 0xff00));
+
+            materialize_nz();
+            e.Test8Imm(GUEST_P, flag);
+            size_t taken = e.Jcc(taken_if_set ? CC_NZ : CC_Z);
+            exit_to(next_pc, cycles);
+            e.PatchRel32(taken, e.Position());
+            exit_to(target, cycles + penalty);
+            max_cycles = cycles + penalty;
+            exited = true;
+            break;
+        }
+        }
+        pc = next_pc;
+    }
+    if (cycles == 0) {
+        return nullptr;
+    }
+    if (!exited) {
+        max_cycles = cycles;
+        exit_to(pc, cycles);
+    }
+
+    if (code_used + scratch.size() > CODE_BUFFER_SIZE || blocks_used == MAX_NATIVE_BLOCKS) {
+        Flush();
+    }
+    u8* entry = code + code_used;
+    std::memcpy(entry, scratch.data(), scratch.size());
+    code_used += scratch.size();
+
+    auto& native = blocks[blocks_used++];
+    native.entry = reinterpret_cast<u32 (*)(GuestState*)>(entry);
+    native.max_cycles = max_cycles;
+    native.written_windows = written_windows;
+    return &native;
+#else
+    return nullptr;
+#endif
+}
@@ -0,0 +1,59 @@
+
+#include "renderpool.h"
+
+RenderPool::RenderPool(u32 workers) {
+    threads.reserve(workers);
+    for (u32 i = 0; i < workers; i++) {
+        threads.emplace_back([this, i] { WorkerLoop(i); });
+    }
+}
+
+RenderPool::~RenderPool() {
+    Wait();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop_signal = true;
+    }
+    start_cv.notify_all();
+    for (auto& th : threads) {
+        th.join();
+    }
+}
+
+void RenderPool::Start(Job next) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = std::move(next);
+        bands_left = (u32)threads.size();
+        job_generation++;
+    }
+    start_cv.notify_all();
+}
+
+void RenderPool::Wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] { return bands_left == 0; });
+}
+
+void RenderPool::WorkerLoop(u32 band) {
+    u64 seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            start_cv.wait(lock, [&] { return stop_signal || job_generation != seen_generation; });
+            if (stop_signal)
+                return;
+            seen_generation = job_generation;
+        }
+        // The job isn't replaced until every band has finished, so it's safe to run unlocked
+        job(band, (u32)threads.size());
+        bool last;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            last = --bands_left == 0;
+        }
+        if (last) {
+            done_cv.notify_all();
+        }
+    }
+}
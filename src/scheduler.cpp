@@ -11,31 +11,44 @@ void Scheduler::ScheduleInterrupt(s32 cycles_from_now, InterruptSource source, b
     });
 }
 
+void Scheduler::ScheduleAt(u64 cycles, InterruptSource source) {
+    queue.emplace(Interrupt{
+        .cycles = cycles,
+        .repeats = 0,
+        .source = source,
+        .recurring = false
+    });
+}
+
 s64 Scheduler::CPUCyclesTillInterrupt() const {
     auto& top = queue.top();
     return ((s64)top.cycles - (s64)cycle_count) / NTSC_CPU_CLOCK_DIVIDER;
 }
 
 void Scheduler::AddCPUCycles(s64 cycles) {
-    auto i = queue.top();
     auto next_cycle_count = (cycle_count + cycles * NTSC_CPU_CLOCK_DIVIDER);
-    while (i.cycles < next_cycle_count) {
+    while (!queue.empty() && queue.top().cycles < next_cycle_count) {
+        auto i = queue.top();
         queue.pop();
-        if (i.source == InterruptSource::NMI) {
+        switch (i.source) {
+        case InterruptSource::NMI:
             cpu.pending_nmi = true;
-        } else {
+            break;
+        case InterruptSource::APU:
+        case InterruptSource::External:
             cpu.pending_irq = true;
+            break;
+        case InterruptSource::PPUStatus:
+            break;
         }
         if (i.recurring) {
             queue.emplace(Interrupt{
                     .cycles = i.cycles + i.repeats,
                     .repeats = i.repeats,
+                    .source = i.source,
                     .recurring = true
             });
         }
-        i = queue.top();
-        if (queue.empty())
-            break;
     }
     cycle_count = next_cycle_count;
     frame_count = cycle_count / NTSC_CLOCK_PER_FRAME;
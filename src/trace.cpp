@@ -0,0 +1,181 @@
+
+#include <chrono>
+#include <cstring>
+
+#include "trace.h"
+
+static constexpr std::array<std::string_view, 256> inst_name_lut = {{
+        "BRK_IMM", "ORA_INX", "STP_IMP", "SLO_INX", "NOP_ZPA", "ORA_ZPA", "ASL_ZPA", "SLO_ZPA",
+        "PHP_IMP", "ORA_IMM", "ASL_IMP", "ANC_IMM", "NOP_ABS", "ORA_ABS", "ASL_ABS", "SLO_ABS",
+        "BPL_REL", "ORA_INY", "STP_IMP", "SLO_INY", "NOP_ZPX", "ORA_ZPX", "ASL_ZPX", "SLO_ZPX",
+        "CLC_IMP", "ORA_ABY", "NOP_IMP", "SLO_ABY", "NOP_ABX", "ORA_ABX", "ASL_ABX", "SLO_ABX",
+        "JSR_ABS", "AND_INX", "STP_IMP", "RLA_INX", "BIT_ZPA", "AND_ZPA", "ROL_ZPA", "RLA_ZPA",
+        "PLP_IMP", "AND_IMM", "ROL_IMP", "ANC_IMM", "BIT_ABS", "AND_ABS", "ROL_ABS", "RLA_ABS",
+        "BMI_REL", "AND_INY", "STP_IMP", "RLA_INY", "NOP_ZPX", "AND_ZPX", "ROL_ZPX", "RLA_ZPX",
+        "SEC_IMP", "AND_ABY", "NOP_IMP", "RLA_ABY", "NOP_ABX", "AND_ABX", "ROL_ABX", "RLA_ABX",
+        "RTI_IMP", "EOR_INX", "STP_IMP", "SRE_INX", "NOP_ZPA", "EOR_ZPA", "LSR_ZPA", "SRE_ZPA",
+        "PHA_IMP", "EOR_IMM", "LSR_IMP", "ALR_IMM", "JMP_ABS", "EOR_ABS", "LSR_ABS", "SRE_ABS",
+        "BVC_REL", "EOR_INY", "STP_IMP", "SRE_INY", "NOP_ZPX", "EOR_ZPX", "LSR_ZPX", "SRE_ZPX",
+        "CLI_IMP", "EOR_ABY", "NOP_IMP", "SRE_ABY", "NOP_ABX", "EOR_ABX", "LSR_ABX", "SRE_ABX",
+        "RTS_IMP", "ADC_INX", "STP_IMP", "RRA_INX", "NOP_ZPA", "ADC_ZPA", "ROR_ZPA", "RRA_ZPA",
+        "PLA_IMP", "ADC_IMM", "ROR_IMP", "ARR_IMM", "JMP_IND", "ADC_ABS", "ROR_ABS", "RRA_ABS",
+        "BVS_REL", "ADC_INY", "STP_IMP", "RRA_INY", "NOP_ZPX", "ADC_ZPX", "ROR_ZPX", "RRA_ZPX",
+        "SEI_IMP", "ADC_ABY", "NOP_IMP", "RRA_ABY", "NOP_ABX", "ADC_ABX", "ROR_ABX", "RRA_ABX",
+        "NOP_IMM", "STA_INX", "NOP_IMM", "SAX_INX", "STY_ZPA", "STA_ZPA", "STX_ZPA", "SAX_ZPA",
+        "DEY_IMP", "NOP_IMM", "TXA_IMP", "XAA_IMM", "STY_ABS", "STA_ABS", "STX_ABS", "SAX_ABS",
+        "BCC_REL", "STA_INY", "STP_IMP", "AHX_INY", "STY_ZPX", "STA_ZPX", "STX_ZPY", "SAX_ZPY",
+        "TYA_IMP", "STA_ABY", "TXS_IMP", "TAS_ABY", "SHY_ABX", "STA_ABX", "SHX_ABY", "AHX_ABY",
+        "LDY_IMM", "LDA_INX", "LDX_IMM", "LAX_INX", "LDY_ZPA", "LDA_ZPA", "LDX_ZPA", "LAX_ZPA",
+        "TAY_IMP", "LDA_IMM", "TAX_IMP", "LAX_IMM", "LDY_ABS", "LDA_ABS", "LDX_ABS", "LAX_ABS",
+        "BCS_REL", "LDA_INY", "STP_IMP", "LAX_INY", "LDY_ZPX", "LDA_ZPX", "LDX_ZPY", "LAX_ZPY",
+        "CLV_IMP", "LDA_ABY", "TSX_IMP", "LAS_ABY", "LDY_ABX", "LDA_ABX", "LDX_ABY", "LAX_ABY",
+        "CPY_IMM", "CMP_INX", "NOP_IMM", "DCP_INX", "CPY_ZPA", "CMP_ZPA", "DEC_ZPA", "DCP_ZPA",
+        "INY_IMP", "CMP_IMM", "DEX_IMP", "AXS_IMM", "CPY_ABS", "CMP_ABS", "DEC_ABS", "DCP_ABS",
+        "BNE_REL", "CMP_INY", "STP_IMP", "DCP_INY", "NOP_ZPX", "CMP_ZPX", "DEC_ZPX", "DCP_ZPX",
+        "CLD_IMP", "CMP_ABY", "NOP_IMP", "DCP_ABY", "NOP_ABX", "CMP_ABX", "DEC_ABX", "DCP_ABX",
+        "CPX_IMM", "SBC_INX", "NOP_IMM", "ISC_INX", "CPX_ZPA", "SBC_ZPA", "INC_ZPA", "ISC_ZPA",
+        "INX_IMP", "SBC_IMM", "NOP_IMP", "SBC_IMM", "CPX_ABS", "SBC_ABS", "INC_ABS", "ISC_ABS",
+        "BEQ_REL", "SBC_INY", "STP_IMP", "ISC_INY", "NOP_ZPX", "SBC_ZPX", "INC_ZPX", "ISC_ZPX",
+        "SED_IMP", "SBC_ABY", "NOP_IMP", "ISC_ABY", "NOP_ABX", "SBC_ABX", "INC_ABX", "ISC_ABX",
+}};
+
+std::string_view OpcodeName(u8 opcode) {
+    return inst_name_lut[opcode];
+}
+
+TraceWriter::TraceWriter() : ring(std::make_unique<TraceRecord[]>(RING_SIZE)) {}
+
+TraceWriter::~TraceWriter() {
+    Close();
+}
+
+bool TraceWriter::Open(const std::string& path) {
+    Close();
+    file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        SPDLOG_WARN("Failed to open trace file {}", path);
+        return false;
+    }
+    std::fwrite(MAGIC, sizeof(MAGIC), 1, file);
+    previous.fill(0);
+    zero_run = 0;
+    stop_signal.store(false, std::memory_order_release);
+    writer = std::thread([this] { WriterLoop(); });
+    return true;
+}
+
+void TraceWriter::Close() {
+    if (!file) {
+        return;
+    }
+    stop_signal.store(true, std::memory_order_release);
+    if (writer.joinable())
+        writer.join();
+    std::fclose(file);
+    file = nullptr;
+}
+
+void TraceWriter::Compress(const TraceRecord& record) {
+    std::array<u8, sizeof(TraceRecord)> bytes{};
+    std::memcpy(bytes.data(), &record, sizeof(TraceRecord));
+    for (size_t i = 0; i < bytes.size(); i++) {
+        const u8 delta = bytes[i] ^ previous[i];
+        if (delta == 0) {
+            if (++zero_run == 0xff) {
+                out.push_back(0);
+                out.push_back(zero_run);
+                zero_run = 0;
+            }
+            continue;
+        }
+        if (zero_run != 0) {
+            out.push_back(0);
+            out.push_back(zero_run);
+            zero_run = 0;
+        }
+        out.push_back(delta);
+    }
+    previous = bytes;
+}
+
+void TraceWriter::WriterLoop() {
+    using namespace std::chrono_literals;
+    // Hand slots back to the emulator in chunks so it doesn't wait on a whole ring of compression
+    constexpr u64 BATCH_SIZE = 4096;
+    while (true) {
+        u64 tail = read_index.load(std::memory_order_relaxed);
+        const u64 head = write_index.load(std::memory_order_acquire);
+        if (tail == head) {
+            if (stop_signal.load(std::memory_order_acquire)) {
+                break;
+            }
+            std::this_thread::sleep_for(1ms);
+            continue;
+        }
+        const u64 end = std::min(head, tail + BATCH_SIZE);
+        for (; tail != end; tail++) {
+            Compress(ring[tail & (RING_SIZE - 1)]);
+        }
+        read_index.store(tail, std::memory_order_release);
+        std::fwrite(out.data(), 1, out.size(), file);
+        out.clear();
+    }
+    if (zero_run != 0) {
+        out.push_back(0);
+        out.push_back(zero_run);
+        zero_run = 0;
+    }
+    std::fwrite(out.data(), 1, out.size(), file);
+    out.clear();
+}
+
+TraceReader::~TraceReader() {
+    if (file)
+        std::fclose(file);
+}
+
+bool TraceReader::Open(const std::string& path) {
+    file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    char magic[sizeof(TraceWriter::MAGIC)];
+    if (std::fread(magic, sizeof(magic), 1, file) != 1
+            || std::memcmp(magic, TraceWriter::MAGIC, sizeof(magic)) != 0) {
+        std::fclose(file);
+        file = nullptr;
+        return false;
+    }
+    return true;
+}
+
+int TraceReader::ReadByte() {
+    if (zero_run != 0) {
+        zero_run--;
+        return 0;
+    }
+    int c = std::fgetc(file);
+    if (c != 0) {
+        return c;
+    }
+    c = std::fgetc(file);
+    if (c == EOF) {
+        return EOF;
+    }
+    zero_run = c - 1;
+    return 0;
+}
+
+bool TraceReader::Next(TraceRecord& record) {
+    std::array<u8, sizeof(TraceRecord)> bytes{};
+    for (size_t i = 0; i < bytes.size(); i++) {
+        const int delta = ReadByte();
+        if (delta == EOF) {
+            return false;
+        }
+        bytes[i] = previous[i] ^ delta;
+    }
+    previous = bytes;
+    std::memcpy(&record, bytes.data(), sizeof(TraceRecord));
+    return true;
+}
@@ -0,0 +1,60 @@
+
+#include <deque>
+#include <iostream>
+
+#include <argparse/argparse.hpp>
+
+#include "scheduler.h"
+#include "trace.h"
+
+// Prints a trace written by TraceWriter as text, one instruction per line
+int main(int argc, char** argv) {
+    argparse::ArgumentParser program("brutenes-tracedump");
+    program.add_argument("tracefile");
+    program.add_argument("-n", "--last")
+        .help("only print the last N instructions")
+        .scan<'u', u64>()
+        .default_value((u64)0);
+
+    try {
+        program.parse_args(argc, argv);
+    }
+    catch (const std::exception& err) {
+        std::cerr << err.what() << std::endl;
+        std::cerr << program;
+        return 1;
+    }
+
+    const auto filename = program.get("tracefile");
+    TraceReader reader;
+    if (!reader.Open(filename)) {
+        std::cerr << "Not a BruteNES trace file: " << filename << std::endl;
+        return 1;
+    }
+
+    const auto print = [](const TraceRecord& r) {
+        fmt::print("{:>12} ${:04X}: {:02X} {} ${:04X} A:{:02X} X:{:02X} Y:{:02X} SP:{:02X} P:{:02X}\n",
+                   r.cycle / Scheduler::NTSC_CPU_CLOCK_DIVIDER, r.pc, r.opcode, OpcodeName(r.opcode), r.operand,
+                   r.a, r.x, r.y, r.sp, r.p);
+    };
+
+    const auto last = program.get<u64>("--last");
+    TraceRecord record{};
+    if (last == 0) {
+        while (reader.Next(record)) {
+            print(record);
+        }
+        return 0;
+    }
+
+    std::deque<TraceRecord> tail{};
+    while (reader.Next(record)) {
+        if (tail.size() == last)
+            tail.pop_front();
+        tail.push_back(record);
+    }
+    for (const auto& r : tail) {
+        print(r);
+    }
+    return 0;
+}
@@ -1,4 +1,6 @@
 
+#include <algorithm>
+
 #include <range/v3/view.hpp>
 
 #ifdef WIN32
@@ -15,6 +17,10 @@
 #include "ines.h"
 #include "virtmem.h"
 
+#ifdef BRUTENES_VIRTMEM_BMI2
+#include <immintrin.h>
+#endif
+
 void FakeVirtualMemory::InitCPUMap(std::span<u8> rawprg) {
     constexpr auto banksize = FakeVirtualMemory::BANK_WINDOW;
     // Load the PRG and CHR into the backing memory
@@ -32,14 +38,12 @@ void FakeVirtualMemory::InitCPUMap(std::span<u8> rawprg) {
     for (; addr < 0x2000; addr += banksize) {
         // Offset bounces between 0 and banksize;
         u32 offset = (addr & banksize);
-        cpumem[addr / banksize] = ciram.data() + offset;
-        cputag[addr / banksize] = Tag::Read | Tag::Write;
+        MapCPUBank(addr, ciram.data() + offset, Tag::Read | Tag::Write);
     }
 
     // MMIO - don't cpumem memory, let the PPU handle these
     for (addr = 0x2000; addr < 0x6000; addr += banksize) {
-        cpumem[addr / banksize] = nullptr;
-        cputag[addr / banksize] = FakeVirtualMemory::Tag::MMIO;
+        MapCPUBank(addr, nullptr, Tag::MMIO);
     }
 
     // PRG - Map these starting from the end.
@@ -49,8 +53,7 @@ void FakeVirtualMemory::InitCPUMap(std::span<u8> rawprg) {
             | ranges::views::slice(0, prg_bank_count * banksize)
             | ranges::views::chunk(banksize)
             | ranges::views::reverse) {
-        cpumem[addr / banksize] = view.data();
-        cputag[addr / banksize] = FakeVirtualMemory::Tag::Read;
+        MapCPUBank(addr, view.data(), Tag::Read);
         addr -= banksize;
         if (addr < 0x6000) {
             break;
@@ -58,10 +61,37 @@ void FakeVirtualMemory::InitCPUMap(std::span<u8> rawprg) {
     }
 }
 
+void FakeVirtualMemory::MapCPUBank(u16 addr, u8* mem, u8 tag) {
+    const auto bank = addr / BANK_WINDOW;
+    cpumem[bank] = mem;
+    cputag[bank] = tag;
+    cpu_map_generation[bank]++;
+
+    // Moving this window can change which window owns the write counter for the memory it
+    // used to share with others. Windows whose owner changes start a new map generation,
+    // since the new owner's count has nothing to do with the one they were compared against.
+    for (u32 i = 0; i < BANK_COUNT; i++) {
+        u8 alias = i;
+        if (cpumem[i] != nullptr) {
+            for (u32 j = 0; j < i; j++) {
+                if (cpumem[j] == cpumem[i]) {
+                    alias = j;
+                    break;
+                }
+            }
+        }
+        if (cpu_write_alias[i] != alias) {
+            cpu_write_alias[i] = alias;
+            cpu_map_generation[i]++;
+        }
+    }
+}
+
 void FakeVirtualMemory::InitPPUMap(std::span<u8> rawchr, const INES& header) {
     constexpr auto banksize = FakeVirtualMemory::BANK_WINDOW;
 
-    // If the game has chr-rom then it will be nonempty
+    // If the game has chr-rom then it will be nonempty, otherwise the pattern tables are CHR RAM
+    u8 chr_tag = Tag::Read;
     if (!rawchr.empty()) {
 //        int i = 0;
 //        for (const auto &view: rawchr | ranges::views::chunk(banksize)) {
@@ -70,42 +100,29 @@ void FakeVirtualMemory::InitPPUMap(std::span<u8> rawchr, const INES& header) {
 //        chr_bank_count = i;
         std::copy(rawchr.begin(), rawchr.end(), chr.data());
         chr_bank_count = rawchr.size() / banksize;
+    } else {
+        // CHR RAM goes in the pattern tables the same way CHR ROM does, so only its first 8KB
+        // is ever mapped. That's all of it on NROM, the only mapper supported, which can't bank it.
+        chr_bank_count = std::max<u32>(header.chr_ram_size, 0x2000) / banksize;
+        chr_tag = Tag::Read | Tag::Write;
+    }
+    chr_size = chr_bank_count * banksize;
 
-        u32 addr = 0x0;
-        for (auto view: chr
-                | ranges::views::slice(0, chr_bank_count * banksize)
-                | ranges::views::chunk(banksize)) {
-            u8 tag = Tag::Read;
-            pputag[addr / banksize] = tag;
-            ppumem[addr / banksize] = view.data();
-            chr_pixel_map[addr / banksize] = &decoded_pixel_cache[addr*4];
-            addr += banksize;
-        }
-
-        // Decode the CHR blocks into pixels in a cache
-        constexpr int TILE_STRIDE = 64;
-        constexpr int PIXEL_STRIDE = 8;
-        // for each tile
-        for (int n=0; n < chr_bank_count * banksize / 16; ++n) {
-            u32 offset = n * 16;
-            u32 x = (n % 16) * TILE_STRIDE;
-            u32 y = (n / 16) * TILE_STRIDE * 16;
-            // for each pixel
-            for (int j=0; j < 8; ++j) {
-                u8 plane0 = chr[offset + j];
-                u8 plane1 = chr[offset + j + 8];
-                for (int k=0; k < 8; ++k) {
-                    u8 pixelbit = 7-k;
-                    u8 bit0 = (plane0>>pixelbit) & 1;
-                    u8 bit1 = ((plane1>>pixelbit) & 1) << 1;
-                    u8 color = (bit0 | bit1);
-                    u32 idx = x + k + y + j * PIXEL_STRIDE;
-                    decoded_pixel_cache[idx] = color;
-                }
-            }
+    u32 addr = 0x0;
+    for (auto view: chr
+            | ranges::views::slice(0, chr_bank_count * banksize)
+            | ranges::views::chunk(banksize)) {
+        if (addr >= 0x2000) {
+            break;
         }
+        pputag[addr / banksize] = chr_tag;
+        ppumem[addr / banksize] = view.data();
+        addr += banksize;
     }
 
+    // Tiles are decoded into the pixel cache the first time they're looked up
+    SetPixelCache(pixel_cache);
+
     // Map nametables
     switch (header.mirroring) {
     case INES::Mirroring::Vertical:
@@ -160,6 +177,78 @@ void FakeVirtualMemory::InitPPUMap(std::span<u8> rawchr, const INES& header) {
     pputag[0x3c00 / banksize] = pputag[0x2c00 / banksize];
 
     // Palette addresses are handled in the PPU IO handler
+
+    nmt_dirty_rows.fill(~0u);
+}
+
+void FakeVirtualMemory::DecodeCHRTile(u32 tile) {
+    const u32 offset = tile * 16;
+    if (pixel_cache == PixelCache::Packed) {
+        u16* rows = &packed_pixel_cache[offset / 2];
+        for (int j = 0; j < 8; ++j) {
+            u8 plane0 = chr[offset + j];
+            u8 plane1 = chr[offset + j + 8];
+            u16 packed = 0;
+            for (int k = 0; k < 8; ++k) {
+                u8 pixelbit = 7 - k;
+                u16 bit0 = (plane0 >> pixelbit) & 1;
+                u16 bit1 = ((plane1 >> pixelbit) & 1) << 1;
+                packed |= (bit0 | bit1) << (k * 2);
+            }
+            rows[j] = packed;
+        }
+    } else {
+        u8* pixels = &decoded_pixel_cache[offset * 4];
+        for (int j = 0; j < 8; ++j) {
+            u8 plane0 = chr[offset + j];
+            u8 plane1 = chr[offset + j + 8];
+            for (int k = 0; k < 8; ++k) {
+                u8 pixelbit = 7 - k;
+                u8 bit0 = (plane0 >> pixelbit) & 1;
+                u8 bit1 = ((plane1 >> pixelbit) & 1) << 1;
+                pixels[j * 8 + k] = (bit0 | bit1);
+            }
+        }
+    }
+    chr_tile_dirty[tile / 64] &= ~(1ull << (tile % 64));
+}
+
+void FakeVirtualMemory::SetPixelCache(PixelCache mode) {
+    pixel_cache = mode;
+    if (mode == PixelCache::Packed) {
+        decoded_pixel_cache = {};
+        packed_pixel_cache.assign(chr_size / 2, 0);
+    } else {
+        packed_pixel_cache = {};
+        decoded_pixel_cache.assign(chr_size * 4, 0);
+    }
+#ifdef BRUTENES_VIRTMEM_BMI2
+    packed_row_pdep = mode == PixelCache::Packed && __builtin_cpu_supports("bmi2");
+#endif
+    chr_tile_dirty.fill(~0ull);
+}
+
+#ifdef BRUTENES_VIRTMEM_BMI2
+__attribute__((target("bmi2")))
+u64 FakeVirtualMemory::ExpandPackedRowBMI2(u16 packed) {
+    return _pdep_u64(packed, 0x0303030303030303ull);
+}
+#endif
+
+const u8* FakeVirtualMemory::NametableRowPalettes(u32 bank, u8 coarse_y) {
+    const auto index = (ppumem[bank] - nmt.data()) / BANK_WINDOW;
+    u8* row = &nmt_palette[(index * 32 + coarse_y) * 32];
+    if ((nmt_dirty_rows[index] & (1u << coarse_y)) != 0) {
+        // Each attribute byte covers a 4x4 tile area, two bits per 2x2 quadrant
+        const u8* attributes = &ppumem[bank][ATTRIBUTE_OFFSET + (coarse_y / 4) * 8];
+        const u8 shift_y = (coarse_y & 0b10) << 1;
+        for (int coarse_x = 0; coarse_x < 32; coarse_x++) {
+            const u8 shift = shift_y | (coarse_x & 0b10);
+            row[coarse_x] = (attributes[coarse_x / 4] >> shift) & 0b11;
+        }
+        nmt_dirty_rows[index] &= ~(1u << coarse_y);
+    }
+    return row;
 }
 
 //